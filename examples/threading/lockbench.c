@@ -0,0 +1,485 @@
+/**
+ * Lock primitive contention benchmark.
+ *
+ * Every benchmark thread runs the same wait/lock/hold/release workload as
+ * threadfunc() in threading.c, but in a tight loop, against one of several
+ * pluggable lock primitives.  The benchmark sweeps thread counts and hold
+ * times and reports throughput, per-thread fairness and the latency of
+ * acquiring the lock.
+ *
+ *   lockbench [-l locks] [-t threads] [-H hold_ns] [-w wait_ns] [-d ms] [-r read_pct]
+ *
+ *   -l  comma separated primitives (default: all)
+ *       mutex, adaptive, ticket, futex, rwlock
+ *   -t  comma separated thread counts (default: 1,2,4,8)
+ *   -H  comma separated hold times in ns (default: 0,100,1000,10000)
+ *   -w  time spent outside the lock between acquisitions, ns (default: 100)
+ *   -d  duration of each run in ms (default: 200)
+ *   -r  percentage of acquisitions taken as readers by rwlock (default: 0)
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERROR_LOG(msg, ...) fprintf(stderr, "lockbench ERROR: " msg "\n", ##__VA_ARGS__)
+
+#define MAX_LIST 16
+#define MAX_SAMPLES (1 << 14)  // acquire latency samples kept per thread
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+/*---------------- Lock primitives ------------------*/
+
+/**
+ * A lock primitive under test.  rdlock is optional and only used by
+ * primitives that distinguish readers from writers.
+ */
+struct lock_ops {
+    const char *name;
+    void *(*create)(void);
+    void (*lock)(void *lock);
+    void (*rdlock)(void *lock);
+    void (*unlock)(void *lock);
+    void (*destroy)(void *lock);
+};
+
+static void *mutex_create(void) {
+    pthread_mutex_t *m = malloc(sizeof(*m));
+    if (m) pthread_mutex_init(m, NULL);
+    return m;
+}
+
+static void *adaptive_create(void) {
+    pthread_mutex_t *m = malloc(sizeof(*m));
+    if (!m) return NULL;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return m;
+}
+
+static void mutex_lock(void *lock) {
+    pthread_mutex_lock(lock);
+}
+
+static void mutex_unlock(void *lock) {
+    pthread_mutex_unlock(lock);
+}
+
+static void mutex_destroy(void *lock) {
+    pthread_mutex_destroy(lock);
+    free(lock);
+}
+
+/* FIFO spinlock: threads take a ticket and spin until it is served */
+struct ticket_lock {
+    atomic_uint next;
+    atomic_uint owner;
+};
+
+static void *ticket_create(void) {
+    return calloc(1, sizeof(struct ticket_lock));
+}
+
+static void ticket_lock(void *lock) {
+    struct ticket_lock *t = lock;
+    unsigned int ticket = atomic_fetch_add_explicit(&t->next, 1, memory_order_relaxed);
+    while (atomic_load_explicit(&t->owner, memory_order_acquire) != ticket) {
+        cpu_relax();
+    }
+}
+
+static void ticket_unlock(void *lock) {
+    struct ticket_lock *t = lock;
+    unsigned int owner = atomic_load_explicit(&t->owner, memory_order_relaxed);
+    atomic_store_explicit(&t->owner, owner + 1, memory_order_release);
+}
+
+/**
+ * Futex based mutex with the three states 0 (unlocked), 1 (locked) and
+ * 2 (locked with waiters), from Drepper's "Futexes Are Tricky".  Unlock only
+ * enters the kernel when somebody may be waiting.
+ */
+static void *futex_create(void) {
+    return calloc(1, sizeof(atomic_int));
+}
+
+static long futex(atomic_int *uaddr, int op, int val) {
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static void futex_lock(void *lock) {
+    atomic_int *f = lock;
+    int c = 0;
+    if (atomic_compare_exchange_strong(f, &c, 1)) return;
+    if (c != 2) c = atomic_exchange(f, 2);
+    while (c != 0) {
+        futex(f, FUTEX_WAIT_PRIVATE, 2);
+        c = atomic_exchange(f, 2);
+    }
+}
+
+static void futex_unlock(void *lock) {
+    atomic_int *f = lock;
+    if (atomic_fetch_sub(f, 1) != 1) {
+        atomic_store(f, 0);
+        futex(f, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+static void *rwlock_create(void) {
+    pthread_rwlock_t *rw = malloc(sizeof(*rw));
+    if (rw) pthread_rwlock_init(rw, NULL);
+    return rw;
+}
+
+static void rwlock_wrlock(void *lock) {
+    pthread_rwlock_wrlock(lock);
+}
+
+static void rwlock_rdlock(void *lock) {
+    pthread_rwlock_rdlock(lock);
+}
+
+static void rwlock_unlock(void *lock) {
+    pthread_rwlock_unlock(lock);
+}
+
+static void rwlock_destroy(void *lock) {
+    pthread_rwlock_destroy(lock);
+    free(lock);
+}
+
+static const struct lock_ops LOCKS[] = {
+    {"mutex", mutex_create, mutex_lock, NULL, mutex_unlock, mutex_destroy},
+    {"adaptive", adaptive_create, mutex_lock, NULL, mutex_unlock, mutex_destroy},
+    {"ticket", ticket_create, ticket_lock, NULL, ticket_unlock, free},
+    {"futex", futex_create, futex_lock, NULL, futex_unlock, free},
+    {"rwlock", rwlock_create, rwlock_wrlock, rwlock_rdlock, rwlock_unlock, rwlock_destroy},
+};
+enum { NUM_LOCKS = sizeof(LOCKS) / sizeof(LOCKS[0]) };
+
+/*---------------- Workload ------------------*/
+
+/* state shared by all threads of one run */
+struct bench_run {
+    const struct lock_ops *ops;
+    void *lock;
+    long hold_ns;
+    long wait_ns;
+    int read_pct;
+    pthread_barrier_t start;
+    atomic_bool stop;
+    uint64_t protected_counter;  // only touched by writers while holding the lock
+};
+
+/* per thread state, the benchmark counterpart of struct thread_data */
+struct bench_thread_data {
+    struct bench_run *run;
+    unsigned int seed;
+    uint64_t ops;
+    uint64_t writes;
+    uint64_t seen;  // acquisitions considered for sampling
+    uint64_t max_ns;  // worst acquire, the sample may not contain it
+    size_t nsamples;
+    uint64_t samples[MAX_SAMPLES];
+};
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* busy wait, sleeping would measure the scheduler rather than the lock */
+static inline void spin_ns(long ns) {
+    if (ns <= 0) return;
+    uint64_t end = now_ns() + ns;
+    while (now_ns() < end) {
+        cpu_relax();
+    }
+}
+
+/* reservoir sampling keeps a uniform sample of acquire latencies */
+static void record_latency(struct bench_thread_data *data, uint64_t ns) {
+    if (ns > data->max_ns) data->max_ns = ns;
+    data->seen++;
+    if (data->nsamples < MAX_SAMPLES) {
+        data->samples[data->nsamples++] = ns;
+        return;
+    }
+    uint64_t slot = ((uint64_t)rand_r(&data->seed) << 31 | rand_r(&data->seed)) % data->seen;
+    if (slot < MAX_SAMPLES) data->samples[slot] = ns;
+}
+
+static void *benchfunc(void *thread_param) {
+    struct bench_thread_data *data = thread_param;
+    struct bench_run *run = data->run;
+    const struct lock_ops *ops = run->ops;
+
+    pthread_barrier_wait(&run->start);
+
+    while (!atomic_load_explicit(&run->stop, memory_order_relaxed)) {
+        spin_ns(run->wait_ns);
+
+        bool reader = ops->rdlock && run->read_pct > 0 && (rand_r(&data->seed) % 100) < run->read_pct;
+
+        uint64_t t0 = now_ns();
+        if (reader) {
+            ops->rdlock(run->lock);
+        } else {
+            ops->lock(run->lock);
+        }
+        uint64_t t1 = now_ns();
+
+        if (!reader) {
+            run->protected_counter++;
+            data->writes++;
+        }
+        spin_ns(run->hold_ns);
+        ops->unlock(run->lock);
+
+        data->ops++;
+        record_latency(data, t1 - t0);
+    }
+
+    return thread_param;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t idx = (size_t)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[idx];
+}
+
+/* run one (lock, threads, hold) configuration and print one result row */
+static bool run_one(const struct lock_ops *ops, int nthreads, long hold_ns, long wait_ns,
+                    int duration_ms, int read_pct) {
+    struct bench_run run = {
+        .ops = ops,
+        .hold_ns = hold_ns,
+        .wait_ns = wait_ns,
+        .read_pct = read_pct,
+    };
+    bool ok = false;
+    int started = 0;
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    struct bench_thread_data **data = calloc(nthreads, sizeof(*data));
+    uint64_t *all = NULL;
+
+    if (!threads || !data || !(run.lock = ops->create())) {
+        ERROR_LOG("Failed to allocate run for %s", ops->name);
+        goto cleanup;
+    }
+    pthread_barrier_init(&run.start, NULL, nthreads + 1);
+
+    for (; started < nthreads; started++) {
+        data[started] = calloc(1, sizeof(struct bench_thread_data));
+        if (!data[started]) break;
+        data[started]->run = &run;
+        data[started]->seed = (unsigned int)(now_ns() ^ (started * 2654435761u));
+        if (pthread_create(&threads[started], NULL, benchfunc, data[started]) != 0) {
+            free(data[started]);
+            data[started] = NULL;
+            break;
+        }
+    }
+    if (started != nthreads) {
+        // the barrier can never be satisfied, there is no clean way back
+        ERROR_LOG("Failed to start %d threads for %s", nthreads, ops->name);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_wait(&run.start);
+    uint64_t begin = now_ns();
+    struct timespec ts = {duration_ms / 1000, (duration_ms % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+    atomic_store(&run.stop, true);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double secs = (now_ns() - begin) / 1e9;
+    pthread_barrier_destroy(&run.start);
+
+    uint64_t total = 0, writes = 0, min_ops = UINT64_MAX, max_ops = 0, max_ns = 0;
+    double sum_sq = 0;
+    size_t nall = 0;
+    for (int i = 0; i < nthreads; i++) {
+        uint64_t n = data[i]->ops;
+        total += n;
+        writes += data[i]->writes;
+        sum_sq += (double)n * n;
+        if (n < min_ops) min_ops = n;
+        if (n > max_ops) max_ops = n;
+        if (data[i]->max_ns > max_ns) max_ns = data[i]->max_ns;
+        nall += data[i]->nsamples;
+    }
+
+    all = malloc((nall ? nall : 1) * sizeof(uint64_t));
+    if (!all) {
+        ERROR_LOG("Failed to allocate latency samples");
+        goto cleanup;
+    }
+    nall = 0;
+    for (int i = 0; i < nthreads; i++) {
+        memcpy(all + nall, data[i]->samples, data[i]->nsamples * sizeof(uint64_t));
+        nall += data[i]->nsamples;
+    }
+    qsort(all, nall, sizeof(uint64_t), cmp_u64);
+
+    // Jain's fairness index: 1.0 when every thread got the same share
+    double jain = sum_sq > 0 ? ((double)total * total) / (nthreads * sum_sq) : 1.0;
+
+    printf("%-9s %7d %8ld %13.0f %7.3f %10lu %10lu %9lu %9lu %9lu %11lu%s\n", ops->name, nthreads,
+           hold_ns, total / secs, jain, (unsigned long)min_ops, (unsigned long)max_ops,
+           (unsigned long)percentile(all, nall, 50), (unsigned long)percentile(all, nall, 99),
+           (unsigned long)percentile(all, nall, 99.9), (unsigned long)max_ns,
+           run.protected_counter == writes ? "" : "  MUTUAL EXCLUSION VIOLATED");
+    ok = run.protected_counter == writes;
+
+cleanup:
+    if (run.lock) ops->destroy(run.lock);
+    for (int i = 0; data && i < started; i++) {
+        free(data[i]);
+    }
+    free(all);
+    free(data);
+    free(threads);
+    return ok;
+}
+
+/*---------------- Command line ------------------*/
+
+/* parse "a,b,c" into @out, returns the number of values or -1 */
+static int parse_list(const char *arg, long *out) {
+    int n = 0;
+    const char *p = arg;
+    while (*p) {
+        char *end;
+        errno = 0;
+        long v = strtol(p, &end, 10);
+        if (end == p || errno != 0 || v < 0 || n == MAX_LIST) return -1;
+        out[n++] = v;
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
+    }
+    return n;
+}
+
+static int parse_locks(char *arg, const struct lock_ops **out) {
+    int n = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int i = 0;
+        while (i < NUM_LOCKS && strcmp(LOCKS[i].name, tok) != 0) {
+            i++;
+        }
+        if (i == NUM_LOCKS || n == MAX_LIST) return -1;
+        out[n++] = &LOCKS[i];
+    }
+    return n;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-l locks] [-t threads] [-H hold_ns] [-w wait_ns] [-d ms] [-r read_pct]\n"
+            "  locks: mutex,adaptive,ticket,futex,rwlock\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    const struct lock_ops *locks[MAX_LIST];
+    long threads[MAX_LIST] = {1, 2, 4, 8};
+    long holds[MAX_LIST] = {0, 100, 1000, 10000};
+    int nlocks = NUM_LOCKS, nthreads = 4, nholds = 4;
+    long wait_ns = 100;
+    int duration_ms = 200;
+    int read_pct = 0;
+
+    for (int i = 0; i < NUM_LOCKS; i++) {
+        locks[i] = &LOCKS[i];
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l:t:H:w:d:r:")) != -1) {
+        switch (opt) {
+            case 'l':
+                nlocks = parse_locks(optarg, locks);
+                break;
+            case 't':
+                nthreads = parse_list(optarg, threads);
+                break;
+            case 'H':
+                nholds = parse_list(optarg, holds);
+                break;
+            case 'w':
+                wait_ns = atol(optarg);
+                break;
+            case 'd':
+                duration_ms = atoi(optarg);
+                break;
+            case 'r':
+                read_pct = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (nlocks <= 0 || nthreads <= 0 || nholds <= 0 || duration_ms <= 0 || wait_ns < 0 ||
+        read_pct < 0 || read_pct > 100) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        if (threads[i] < 1) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%-9s %7s %8s %13s %7s %10s %10s %9s %9s %9s %11s\n", "lock", "threads", "hold_ns",
+           "ops/s", "jain", "min_ops", "max_ops", "p50_ns", "p99_ns", "p999_ns", "max_ns");
+
+    bool ok = true;
+    for (int l = 0; l < nlocks; l++) {
+        for (int h = 0; h < nholds; h++) {
+            for (int t = 0; t < nthreads; t++) {
+                ok &= run_one(locks[l], (int)threads[t], holds[h], wait_ns, duration_ms, read_pct);
+            }
+        }
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -57,10 +57,11 @@ fi
 # make clean
 # make
 
+# write all files with one writer process in batch mode
 for i in $( seq 1 $NUMFILES)
 do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\t%s\n' "$WRITEDIR/${username}$i.txt" "$WRITESTR"
+done | writer -b
 
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
 
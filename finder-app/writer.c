@@ -1,38 +1,255 @@
+#define _GNU_SOURCE  // for fallocate()
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
-int main(int argc, char **argv) {
-  openlog(NULL, 0, LOG_USER);  // optional given using defaults
+#define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
+#define MAX_THREADS 64
 
-  if (argc < 3) {
-    syslog(LOG_ERR, "Invalid argument number: %d", (argc - 1));
-    return 1;
-  }
+// one (path, content) pair from the batch manifest
+typedef struct entry_t {
+  char *line;  // owns the getline() buffer, path and content point into it
+  const char *path;
+  const char *content;
+  size_t len;
+} entry_t;
 
-  const char *filepath = argv[1];
-  const char *writestr = argv[2];
+typedef struct batch_t {
+  entry_t *entries;
+  size_t count;
+  bool newline;  // append '\n' after each content
+  atomic_size_t next;
+  size_t skipped;  // malformed manifest lines
+  atomic_size_t failed;
+  atomic_size_t bytes;
+} batch_t;
 
-  int fd = open(filepath, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: writer <file> <string>\n"
+          "       writer -b [-j threads] [-n] < manifest\n"
+          "  manifest lines are \"<file>\\t<string>\"\n");
+}
+
+// Create @path and write @len bytes of @content (plus an optional newline) to
+// it.  The file is preallocated so the data blocks are reserved in one go and
+// the content is written with a single writev().  Returns bytes written or -1.
+static ssize_t write_file(const char *path, const char *content, size_t len, bool newline) {
+  int fd = open(path, O_WRONLY | O_CREAT, FILE_MODE);
   if (fd == -1) {
-    syslog(LOG_ERR, "Failed to open %s: %s", filepath, strerror(errno));
+    syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
     return -1;
   }
 
-  ssize_t nr = write(fd, writestr, strlen(writestr));
-  if (nr == -1) {
-    syslog(LOG_ERR, "Failed writing \"%s\" to %s: %s", writestr, filepath, strerror(errno));
-    return -1;
+  struct iovec iov[2] = {
+      [0] = {.iov_base = (void *)content, .iov_len = len},
+      [1] = {.iov_base = "\n", .iov_len = newline ? 1 : 0},
+  };
+  size_t total = iov[0].iov_len + iov[1].iov_len;
+
+  // preallocation is only a hint, not every filesystem supports it
+  if (total > 0 && fallocate(fd, 0, 0, total) == -1 && errno != EOPNOTSUPP &&
+      errno != ENOSYS) {
+    syslog(LOG_ERR, "Failed to preallocate %s: %s", path, strerror(errno));
   }
 
-  syslog(LOG_DEBUG, "Writing \"%s\" to %s", writestr, filepath);
+  size_t done = 0;
+  struct iovec *cur = iov;
+  int iovcnt = 2;
+  while (done < total) {
+    ssize_t nr = writev(fd, cur, iovcnt);
+    if (nr == -1) {
+      if (errno == EINTR) continue;
+      syslog(LOG_ERR, "Failed writing to %s: %s", path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    done += nr;
+    // skip past fully written vectors and trim a partially written one
+    while (iovcnt > 0 && (size_t)nr >= cur->iov_len) {
+      nr -= cur->iov_len;
+      cur++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      cur->iov_base = (char *)cur->iov_base + nr;
+      cur->iov_len -= nr;
+    }
+  }
 
   if (close(fd) == -1) {
     syslog(LOG_ERR, "Failure on close(): %s", strerror(errno));
     return -1;
   }
+  return done;
+}
+
+static void *batch_worker(void *argument) {
+  batch_t *batch = (batch_t *)argument;
+
+  while (true) {
+    size_t i = atomic_fetch_add(&batch->next, 1);
+    if (i >= batch->count) break;
+
+    entry_t *e = &batch->entries[i];
+    ssize_t nr = write_file(e->path, e->content, e->len, batch->newline);
+    if (nr == -1) {
+      atomic_fetch_add(&batch->failed, 1);
+    } else {
+      atomic_fetch_add(&batch->bytes, nr);
+    }
+  }
+  return NULL;
+}
+
+// Read the whole manifest from @in.  Malformed lines are logged and skipped.
+static bool read_manifest(FILE *in, batch_t *batch) {
+  size_t cap = 0;
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t n;
+  size_t lineno = 0;
+
+  while ((n = getline(&line, &line_cap, in)) != -1) {
+    lineno++;
+    if (n > 0 && line[n - 1] == '\n') line[--n] = '\0';
+    if (n == 0) continue;
+
+    char *tab = strchr(line, '\t');
+    if (tab == NULL || tab == line) {
+      syslog(LOG_ERR, "Manifest line %zu is not \"<file>\\t<string>\"", lineno);
+      batch->skipped++;
+      continue;
+    }
+
+    if (batch->count == cap) {
+      cap = cap ? cap * 2 : 256;
+      entry_t *grown = realloc(batch->entries, cap * sizeof(entry_t));
+      if (grown == NULL) {
+        syslog(LOG_ERR, "Out of memory reading manifest");
+        free(line);
+        return false;
+      }
+      batch->entries = grown;
+    }
+
+    *tab = '\0';
+    batch->entries[batch->count++] = (entry_t){
+        .line = line,
+        .path = line,
+        .content = tab + 1,
+        .len = line + n - (tab + 1),
+    };
+    // hand the buffer over to the entry, getline() allocates a new one
+    line = NULL;
+    line_cap = 0;
+  }
+
+  free(line);
+  return true;
+}
+
+static int run_batch(int nthreads, bool newline) {
+  batch_t batch = {.newline = newline};
+  int ret = 0;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (!read_manifest(stdin, &batch)) {
+    ret = 1;
+    goto cleanup;
+  }
+
+  if ((size_t)nthreads > batch.count) nthreads = batch.count ? batch.count : 1;
+
+  pthread_t tids[MAX_THREADS];
+  int started = 0;
+  for (int i = 1; i < nthreads; i++) {
+    if (pthread_create(&tids[started], NULL, batch_worker, &batch) != 0) break;
+    started++;
+  }
+  batch_worker(&batch);  // the main thread works too
+  for (int i = 0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  if (secs <= 0) secs = 1e-9;
+
+  size_t failed = atomic_load(&batch.failed);
+  size_t bytes = atomic_load(&batch.bytes);
+  size_t written = batch.count - failed;
+  printf("wrote %zu files (%zu bytes) in %.3f ms using %d threads: %.0f files/s, %.2f MB/s\n",
+         written, bytes, secs * 1e3, started + 1, written / secs, bytes / secs / 1e6);
+  syslog(LOG_DEBUG, "Batch wrote %zu files (%zu bytes), %zu failures, %zu skipped", written,
+         bytes, failed, batch.skipped);
+  if (failed || batch.skipped) ret = 1;
+
+cleanup:
+  for (size_t i = 0; i < batch.count; i++) {
+    free(batch.entries[i].line);
+  }
+  free(batch.entries);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  openlog(NULL, 0, LOG_USER);  // optional given using defaults
+
+  bool batch = false;
+  bool newline = false;
+  int nthreads = 1;
+  int opt;
+  // '+' stops at the first non-option, so "writer <file> -abc" still writes "-abc"
+  while ((opt = getopt(argc, argv, "+bj:n")) != -1) {
+    switch (opt) {
+      case 'b':
+        batch = true;
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        if (nthreads < 1 || nthreads > MAX_THREADS) {
+          syslog(LOG_ERR, "Invalid thread count: %s", optarg);
+          usage();
+          return 1;
+        }
+        break;
+      case 'n':
+        newline = true;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (batch) {
+    return run_batch(nthreads, newline);
+  }
+
+  if (argc - optind < 2) {
+    syslog(LOG_ERR, "Invalid argument number: %d", (argc - optind));
+    return 1;
+  }
+
+  const char *filepath = argv[optind];
+  const char *writestr = argv[optind + 1];
+
+  if (write_file(filepath, writestr, strlen(writestr), newline) == -1) {
+    return -1;
+  }
 
+  syslog(LOG_DEBUG, "Writing \"%s\" to %s", writestr, filepath);
   return 0;
 }
@@ -0,0 +1,375 @@
+/*
+ * Replays a capture recorded by aesdsocket --capture against a server.
+ *
+ *   aesdreplay [-H host] [-p port] [-s speed] capture-file
+ *
+ * Connections are opened, fed and closed on the captured schedule scaled by
+ * @speed (1 = real time, 10 = ten times faster, 0 = as fast as possible
+ * while keeping at most as many connections open as the capture had).
+ * Prints the distribution of request latencies: time from sending the last
+ * byte of a connection until the server finished replying.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "capture.h"
+#include "utility.h"
+
+enum { MAX_THREADS = 1024, REPLY_TIMEOUT_MS = 30000, RECV_BUF_SIZE = 64 << 10, THREAD_STACK = 256 << 10 };
+
+typedef struct chunk_t {
+  uint64_t t_us;
+  uint32_t len;
+  char* data;
+} chunk_t;
+
+typedef struct conn_t {
+  uint32_t id;
+  uint64_t open_us;
+  uint64_t close_us;
+  bool closed;        // a CLOSE record was seen
+  chunk_t* chunks;
+  size_t nchunks;
+  size_t cap;
+  // results
+  bool ok;
+  uint64_t latency_us;
+  size_t reply_bytes;
+} conn_t;
+
+typedef struct replay_t {
+  conn_t* conns;      // ordered by open time
+  size_t nconns;
+  struct addrinfo* addr;
+  double speed;
+  uint64_t start_us;
+  atomic_size_t next;
+} replay_t;
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// sleep until capture time @t_us, scaled to replay time
+static void wait_until(const replay_t* r, uint64_t t_us) {
+  if(r->speed <= 0) return;
+  uint64_t due = r->start_us + (uint64_t)(t_us / r->speed);
+  uint64_t now = now_us();
+  if(due <= now) return;
+  struct timespec ts = { (due - now) / 1000000, ((due - now) % 1000000) * 1000 };
+  while(nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+  }
+}
+
+// Connection ids are handed out sequentially from 1, so while loading
+// @slots maps an id to its index in conns plus one (0: not seen yet)
+typedef struct conn_slots_t {
+  size_t* index;
+  size_t cap;
+} conn_slots_t;
+
+static conn_t* find_conn(replay_t* r, uint32_t id, size_t* cap, conn_slots_t* slots) {
+  if(id >= slots->cap) {
+    size_t n = slots->cap ? slots->cap : 64;
+    while(n <= id) n *= 2;
+    size_t* grown = realloc(slots->index, n * sizeof(size_t));
+    if(!grown) return NULL;
+    memset(grown + slots->cap, 0, (n - slots->cap) * sizeof(size_t));
+    slots->index = grown;
+    slots->cap = n;
+  }
+  if(slots->index[id]) return &r->conns[slots->index[id] - 1];
+
+  if(r->nconns == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    conn_t* grown = realloc(r->conns, *cap * sizeof(conn_t));
+    if(!grown) return NULL;
+    r->conns = grown;
+  }
+  conn_t* c = &r->conns[r->nconns++];
+  memset(c, 0, sizeof(*c));
+  c->id = id;
+  slots->index[id] = r->nconns;
+  return c;
+}
+
+static int load_capture(replay_t* r, const char* path) {
+  FILE* f = fopen(path, "r");
+  if(!f) {
+    ERROR_LOG("Failed to open %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  char magic[8];
+  if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, 8) != 0) {
+    ERROR_LOG("%s is not a capture file", path);
+    fclose(f);
+    return -1;
+  }
+
+  size_t cap = 0;
+  conn_slots_t slots = {0};
+  capture_record_t rec;
+  int ret = 0;
+  while(fread(&rec, sizeof(rec), 1, f) == 1) {
+    rec.conn = le32toh(rec.conn);
+    rec.t_us = le64toh(rec.t_us);
+    rec.len = le32toh(rec.len);
+    conn_t* c = find_conn(r, rec.conn, &cap, &slots);
+    if(!c) {
+      ret = -1;
+      break;
+    }
+    if(rec.type == CAPTURE_OPEN) {
+      c->open_us = rec.t_us;
+    } else if(rec.type == CAPTURE_CLOSE) {
+      c->close_us = rec.t_us;
+      c->closed = true;
+    } else if(rec.type == CAPTURE_DATA) {
+      if(c->nchunks == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 4;
+        chunk_t* grown = realloc(c->chunks, c->cap * sizeof(chunk_t));
+        if(!grown) {
+          ret = -1;
+          break;
+        }
+        c->chunks = grown;
+      }
+      chunk_t* ch = &c->chunks[c->nchunks];
+      ch->t_us = rec.t_us;
+      ch->len = rec.len;
+      if((ch->data = malloc(rec.len ? rec.len : 1)) == NULL ||
+         fread(ch->data, 1, rec.len, f) != rec.len) {
+        free(ch->data);
+        ERROR_LOG("Truncated capture record");
+        break;
+      }
+      c->nchunks++;
+    } else {
+      ERROR_LOG("Unknown capture record type %u", rec.type);
+      ret = -1;
+      break;
+    }
+  }
+
+  free(slots.index);
+  fclose(f);
+  return ret;
+}
+
+static int cmp_open(const void* a, const void* b) {
+  const conn_t* x = a;
+  const conn_t* y = b;
+  return (x->open_us > y->open_us) - (x->open_us < y->open_us);
+}
+
+static int send_all(int fd, const char* buf, size_t len) {
+  while(len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if(n == -1 && errno == EINTR) continue;
+    if(n == -1) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void replay_conn(replay_t* r, conn_t* c) {
+  wait_until(r, c->open_us);
+
+  int fd = socket(r->addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd == -1 || connect(fd, r->addr->ai_addr, r->addr->ai_addrlen) == -1) {
+    ERROR_LOG("Connection %u: connect failed: %s", c->id, strerror(errno));
+    if(fd != -1) close(fd);
+    return;
+  }
+
+  for(size_t i = 0; i < c->nchunks; i++) {
+    wait_until(r, c->chunks[i].t_us);
+    if(send_all(fd, c->chunks[i].data, c->chunks[i].len) == -1) {
+      ERROR_LOG("Connection %u: send failed: %s", c->id, strerror(errno));
+      close(fd);
+      return;
+    }
+  }
+  uint64_t sent_us = now_us();
+
+  // an unterminated message only ends when the client closed
+  const chunk_t* last = c->nchunks > 0 ? &c->chunks[c->nchunks - 1] : NULL;
+  bool terminated = last && last->len > 0 && last->data[last->len - 1] == '\n';
+  if(!terminated) {
+    if(c->closed) wait_until(r, c->close_us);
+    shutdown(fd, SHUT_WR);
+  }
+
+  // the server closes once it replied
+  char buf[RECV_BUF_SIZE];
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  while(true) {
+    int ready = poll(&pfd, 1, REPLY_TIMEOUT_MS);
+    if(ready == -1 && errno == EINTR) continue;
+    if(ready <= 0) {
+      ERROR_LOG("Connection %u: no reply", c->id);
+      break;
+    }
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if(n == -1 && errno == EINTR) continue;
+    if(n <= 0) {
+      c->ok = n == 0;
+      c->latency_us = now_us() - sent_us;
+      break;
+    }
+    c->reply_bytes += n;
+  }
+  close(fd);
+}
+
+static void* replay_thread(void* arg) {
+  replay_t* r = arg;
+  while(true) {
+    size_t i = atomic_fetch_add(&r->next, 1);
+    if(i >= r->nconns) break;
+    replay_conn(r, &r->conns[i]);
+  }
+  return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// most connections that were open at the same time during the capture
+static size_t max_concurrency(const replay_t* r) {
+  uint64_t* closes = malloc(r->nconns * sizeof(uint64_t));
+  if(!closes) return r->nconns;
+  for(size_t i = 0; i < r->nconns; i++) {
+    closes[i] = r->conns[i].closed ? r->conns[i].close_us : UINT64_MAX;
+  }
+  qsort(closes, r->nconns, sizeof(uint64_t), cmp_u64);
+
+  // sweep the opens (already sorted) against the sorted closes
+  size_t open = 0, best = 0, j = 0;
+  for(size_t i = 0; i < r->nconns; i++) {
+    while(j < r->nconns && closes[j] < r->conns[i].open_us) {
+      j++;
+      open--;
+    }
+    if(++open > best) best = open;
+  }
+  free(closes);
+  return best;
+}
+
+static uint64_t percentile(const uint64_t* sorted, size_t n, double p) {
+  if(n == 0) return 0;
+  return sorted[(size_t)(p / 100.0 * (n - 1) + 0.5)];
+}
+
+int main(int argc, char** argv) {
+  const char* host = "127.0.0.1";
+  const char* port = "9000";
+  replay_t r = { .speed = 1.0 };
+  int opt;
+  while((opt = getopt(argc, argv, "H:p:s:")) != -1) {
+    switch(opt) {
+      case 'H': host = optarg; break;
+      case 'p': port = optarg; break;
+      case 's': r.speed = atof(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-H host] [-p port] [-s speed] capture-file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if(optind + 1 != argc || r.speed < 0) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-s speed] capture-file\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  int gai = getaddrinfo(host, port, &hints, &r.addr);
+  if(gai != 0) {
+    ERROR_LOG("%s:%s: %s", host, port, gai_strerror(gai));
+    return EXIT_FAILURE;
+  }
+
+  if(load_capture(&r, argv[optind]) == -1 || r.nconns == 0) {
+    ERROR_LOG("Nothing to replay");
+    freeaddrinfo(r.addr);
+    return EXIT_FAILURE;
+  }
+  qsort(r.conns, r.nconns, sizeof(conn_t), cmp_open);
+
+  // one thread per concurrently open connection keeps the original overlap
+  size_t nthreads = max_concurrency(&r);
+  if(nthreads < 1) nthreads = 1;
+  if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, THREAD_STACK);
+  pthread_t* tids = calloc(nthreads, sizeof(pthread_t));
+  size_t started = 0;
+  r.start_us = now_us();
+  for(; tids && started < nthreads; started++) {
+    if(pthread_create(&tids[started], &attr, replay_thread, &r) != 0) break;
+  }
+  if(started == 0) replay_thread(&r);
+  for(size_t i = 0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  double secs = (now_us() - r.start_us) / 1e6;
+  pthread_attr_destroy(&attr);
+
+  uint64_t* lat = malloc(r.nconns * sizeof(uint64_t));
+  size_t nok = 0;
+  size_t reply_bytes = 0;
+  for(size_t i = 0; i < r.nconns; i++) {
+    if(r.conns[i].ok) {
+      if(lat) lat[nok] = r.conns[i].latency_us;
+      nok++;
+      reply_bytes += r.conns[i].reply_bytes;
+    }
+  }
+  if(lat) qsort(lat, nok, sizeof(uint64_t), cmp_u64);
+
+  char speed[32] = "max";
+  if(r.speed > 0) snprintf(speed, sizeof(speed), "%gx", r.speed);
+  printf("replayed %zu connections (%zu failed) on %zu threads in %.3f s at %s speed\n",
+         r.nconns, r.nconns - nok, started, secs, speed);
+  printf("throughput: %.1f requests/s, %.2f MB/s replies\n", nok / secs, reply_bytes / secs / 1e6);
+  if(lat && nok) {
+    printf("latency us: p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  max %lu\n",
+           (unsigned long)percentile(lat, nok, 50), (unsigned long)percentile(lat, nok, 90),
+           (unsigned long)percentile(lat, nok, 99), (unsigned long)percentile(lat, nok, 99.9),
+           (unsigned long)lat[nok - 1]);
+  }
+
+  for(size_t i = 0; i < r.nconns; i++) {
+    for(size_t j = 0; j < r.conns[i].nchunks; j++) {
+      free(r.conns[i].chunks[j].data);
+    }
+    free(r.conns[i].chunks);
+  }
+  free(r.conns);
+  free(lat);
+  free(tids);
+  freeaddrinfo(r.addr);
+  return nok == r.nconns ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -2,6 +2,7 @@
 #include <arpa/inet.h>
 #include <errno.h>  // IWYU pragma: keep
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <pthread.h>
 #include <stdatomic.h>
@@ -15,15 +16,45 @@
 #include <sys/socket.h>
 #include <sys/timerfd.h>
 #include <unistd.h>
+#include "config.h"
 #include "worker.h"
 #include "list.h"
+#include "namespace.h"
+#include "handoff.h"
+#include "coroutine.h"
 #include "utility.h"
 
 /*---------------- Constants ------------------*/
 const char* OUTPUT_FILE_PATH = "/var/tmp/aesdsocketdata";
-const int BACKLOG = 5;
-const int AESD_PORT = 9000;
-const int SEND_BUF_SIZE = 1024;
+const char* HANDOFF_PATH = "/run/aesdsocket.sock";  // root only, unlike /var/tmp
+const unsigned DRAIN_TIMEOUT_S = 90;
+
+// Options of the listening socket.  Buffer sizes are set here, before
+// listen(), so accepted sockets inherit them and the window scale matches.
+static void configure_listen_socket(int fd, const server_config_t* cfg) {
+  if(cfg->rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &cfg->rcvbuf, sizeof(int)) == -1) {
+    ERROR_LOG("SO_RCVBUF: %s", strerror(errno));
+  }
+  if(cfg->sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &cfg->sndbuf, sizeof(int)) == -1) {
+    ERROR_LOG("SO_SNDBUF: %s", strerror(errno));
+  }
+  if(cfg->defer_accept_s &&
+     setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &cfg->defer_accept_s, sizeof(int)) == -1) {
+    ERROR_LOG("TCP_DEFER_ACCEPT: %s", strerror(errno));
+  }
+}
+
+// Options that are set on every accepted socket
+static void configure_client_socket(int fd, const server_config_t* cfg) {
+  int opt_on = 1;
+  if(cfg->tcp_nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt_on, sizeof(int)) == -1) {
+    ERROR_LOG("TCP_NODELAY: %s", strerror(errno));
+  }
+  if(cfg->busy_poll_us &&
+     setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &cfg->busy_poll_us, sizeof(int)) == -1) {
+    ERROR_LOG("SO_BUSY_POLL: %s", strerror(errno));
+  }
+}
 
 int main(int argc, char** argv){
   
@@ -32,47 +63,84 @@ int main(int argc, char** argv){
   int sockfd = -1;     // socket
   int shutdownfd = -1; // to signal worker threads to shutdown
   int timerfd = -1;    // timer file descriptor
-  FILE* outfile = NULL;      // OUTPUT_FILE_PATH:  /var/tmp/aesdsocketdata"
-  pthread_mutex_t outfd_lock = PTHREAD_MUTEX_INITIALIZER;
+  int tickfd = -1;     // drives the connection timer wheel
+  int ctlfd = -1;      // hot upgrade control socket
+  timer_wheel_t wheel;
+  tw_init(&wheel);
+  capture_t* capture = NULL;    // traffic capture, when enabled
+  ns_registry_t registry = {0}; // OUTPUT_FILE_PATH + one log per namespace
+  bool registry_ready = false;
   
-  // parse args
-  bool daemon = false;
-  if(argc == 2 && (strcmp(argv[1], "-d") == 0)){
-    daemon = true;
+  // parse args: config file, then command line overrides (see config.h)
+  server_config_t cfg;
+  config_defaults(&cfg);
+  if(config_parse_args(&cfg, argc, argv) == -1) {
+    return EXIT_FAILURE;
   }
  
   // open syslog
   openlog(NULL, 0, LOG_USER);
 
-  // open output file
-  if ((outfile = fopen(OUTPUT_FILE_PATH, "w+")) == NULL) {
-    ERROR_LOG("%s", strerror(errno));
-    goto cleanup;
-  }
-
   // vars for socket
   struct sockaddr_in sa = {
     .sin_family = AF_INET,
-    .sin_port = htons(AESD_PORT),
+    .sin_port = htons(cfg.port),
     .sin_addr.s_addr = htonl(INADDR_ANY)
   };
   struct sockaddr_in client_sa = {0};
   socklen_t client_sa_len;
  
-  // open listening socket
-  if ((sockfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP)) == -1) goto cleanup; 
-  DEBUG_LOG("Socket open was successful");
-  // Configure socket so can rebind immediatedly, in case of restart or
-  // crash, on same port...and not get hung up by a port's TIME_WAIT state
-  int opt_on = 1;
-  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt_on, sizeof(opt_on));
+  // take over the listening socket of the running server
+  bool took_over = false;
+  if(cfg.upgrade) {
+    if((sockfd = handoff_receive_fd(HANDOFF_PATH)) != -1) {
+      took_over = true;
+      DEBUG_LOG("Took over listening socket from running server");
+    } else {
+      ERROR_LOG("Hot upgrade handoff failed, binding instead: %s", strerror(errno));
+    }
+  }
+
+  if(sockfd == -1) {
+    // open listening socket
+    if ((sockfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP)) == -1) goto cleanup; 
+    DEBUG_LOG("Socket open was successful");
+    // Configure socket so can rebind immediatedly, in case of restart or
+    // crash, on same port...and not get hung up by a port's TIME_WAIT state
+    int opt_on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt_on, sizeof(opt_on));
+    configure_listen_socket(sockfd, &cfg);
+
+    // bind socket
+    if (bind(sockfd, (struct sockaddr *)&sa, sizeof(sa)) == -1) goto cleanup; 
+    DEBUG_LOG("Socket bind was successful");
+  }
+
+  // open output file once the port is ours, so a second instance can't
+  // truncate or "recover" the log of a server that is still writing it.
+  // An upgrade continues the running server's data
+  log_open_mode_t mode = cfg.upgrade ? LOG_CONTINUE : cfg.persistent ? LOG_RECOVER : LOG_TRUNCATE;
+  if (ns_registry_init(&registry, OUTPUT_FILE_PATH, cfg.namespaces, cfg.max_namespaces, mode) == -1) {
+    ERROR_LOG("%s", strerror(errno));
+    goto cleanup;
+  }
+  registry_ready = true;
 
-  // bind socket
-  if (bind(sockfd, (struct sockaddr *)&sa, sizeof(sa)) == -1) goto cleanup; 
-  DEBUG_LOG("Socket bind was successful");
+  // open traffic capture once the port is ours.  The server we took over
+  // from keeps writing its capture while it drains, so use our own file
+  if(cfg.capture_path[0]) {
+    char capture_path[sizeof(cfg.capture_path) + 16];
+    if(took_over) {
+      snprintf(capture_path, sizeof(capture_path), "%s.%d", cfg.capture_path, (int)getpid());
+    } else {
+      snprintf(capture_path, sizeof(capture_path), "%s", cfg.capture_path);
+    }
+    if((capture = capture_open(capture_path)) == NULL) goto cleanup;
+    DEBUG_LOG("Capturing traffic to %s", capture_path);
+  }
 
   // daemonize after bind
-  if(daemon) {
+  if(cfg.daemon) {
     pid_t pid = fork();
     if(pid < 0)   /* fork failed*/ goto cleanup;
     if(pid > 0) { /* fork success, in parent */ 
@@ -90,6 +158,14 @@ int main(int argc, char** argv){
   // block signals SIGINT and SIGTERM to all
   if(pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) goto cleanup;
   if((sigfd = signalfd(-1 /* create fd*/, &mask, SFD_NONBLOCK)) == -1) goto cleanup;
+  // sendfile() has no MSG_NOSIGNAL, a client resetting mid reply must
+  // fail the write with EPIPE instead of killing the server
+  signal(SIGPIPE, SIG_IGN);
+
+  // control socket a future upgrade connects to
+  if((ctlfd = handoff_listen(HANDOFF_PATH)) == -1) {
+    ERROR_LOG("Hot upgrade control socket unavailable: %s", strerror(errno));
+  }
 
   // event file descriptor to broadcast to workers to shutdown
   if((shutdownfd = eventfd(0, EFD_NONBLOCK)) == -1) goto cleanup;
@@ -102,17 +178,58 @@ int main(int argc, char** argv){
   };
   timerfd_settime(timerfd, 0, &its, NULL);
 
+  // setup connection timeout tick
+  if((tickfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) goto cleanup;
+  struct itimerspec tick_its = {
+    .it_value = {0, TW_TICK_MS * 1000000L},
+    .it_interval = {0, TW_TICK_MS * 1000000L}
+  };
+  timerfd_settime(tickfd, 0, &tick_its, NULL);
+
   // setup pollfd array for file descriptors to poll
-  enum { POLLFD_SIZE = 3};
+  enum { POLLFD_SIZE = 5};
   struct pollfd pollfds [POLLFD_SIZE] = {
     [0] = { .fd = sigfd,   .events = POLLIN},
     [1] = { .fd = sockfd,  .events = POLLIN},
-    [2] = { .fd = timerfd, .events = POLLIN}
+    [2] = { .fd = timerfd, .events = POLLIN},
+    [3] = { .fd = tickfd,  .events = POLLIN},
+    [4] = { .fd = ctlfd,   .events = POLLIN}
   };
+
+  // set once the listening socket was handed to a successor
+  bool draining = false;
+  uint64_t drain_deadline = 0;
   
-  // listen
-  if (listen(sockfd, BACKLOG) == -1) goto cleanup;
-  DEBUG_LOG("Server started on port %d", AESD_PORT);
+  // pin the accept thread.  Workers get their own mask, by default the one
+  // we started with, so they don't inherit the accept thread's
+  cpu_set_t worker_cpus;
+  if(cfg.worker_cpus_set) {
+    worker_cpus = cfg.worker_cpus;
+  } else if(sched_getaffinity(0, sizeof(worker_cpus), &worker_cpus) == -1) {
+    CPU_ZERO(&worker_cpus);
+  }
+  if(cfg.accept_cpus_set) {
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cfg.accept_cpus);
+    if(ret != 0) ERROR_LOG("Failed to set accept thread affinity: %s", strerror(ret));
+  }
+  pthread_attr_t worker_attr;
+  pthread_attr_init(&worker_attr);
+  if(CPU_COUNT(&worker_cpus) > 0) {
+    pthread_attr_setaffinity_np(&worker_attr, sizeof(cpu_set_t), &worker_cpus);
+  }
+
+  // coroutine runtime, when connections don't get a thread each
+  co_sched_t* sched = NULL;
+  if(cfg.coroutines > 0) {
+    sched = co_sched_create(cfg.coroutines, cfg.coroutine_stack, shutdownfd,
+                            CPU_COUNT(&worker_cpus) > 0 ? &worker_cpus : NULL);
+    if(sched == NULL) goto cleanup;
+    DEBUG_LOG("Running connections as coroutines on %d threads", cfg.coroutines);
+  }
+
+  // listen (again for a handed over socket, to apply our backlog)
+  if (listen(sockfd, cfg.backlog) == -1) goto cleanup;
+  DEBUG_LOG("Server started on port %d", cfg.port);
   
   // create list to hold thread ids
   node_t* tid_list = NULL;
@@ -150,9 +267,50 @@ int main(int argc, char** argv){
       struct tm* tmp = localtime(&now);
       char ts_str[100] = {0};
       strftime(ts_str, sizeof(ts_str), "%a, %d %b %Y %H:%M:%S %z", tmp);
-      pthread_mutex_lock(&outfd_lock);
-      fprintf(outfile, "timestamp:%s\n", ts_str);
-      pthread_mutex_unlock(&outfd_lock);
+      char line[128];
+      int line_len = snprintf(line, sizeof(line), "timestamp:%s\n", ts_str);
+      datalog_append(registry.default_log, line, line_len);
+    }
+
+    // check for connection timeout tick
+    if(pollfds[3].revents & POLLIN) {
+      uint64_t ticks;
+      if(read(tickfd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+        tw_advance(&wheel, ticks);
+      }
+
+      // after a handoff, exit once the remaining clients are done
+      if(draining) {
+        free_finished_threads(&tid_list);
+        if(tid_list == NULL && (sched == NULL || co_sched_count(sched) == 0)) {
+          DEBUG_LOG("All connections drained");
+          break;
+        }
+        if(tw_now(&wheel) >= drain_deadline) {
+          DEBUG_LOG("Drain timeout, shutting down remaining connections");
+          break;
+        }
+      }
+    }
+
+    // check for hot upgrade: hand the listening socket over and drain
+    if(pollfds[4].revents & POLLIN) {
+      if(handoff_send_fd(&ctlfd, HANDOFF_PATH, sockfd) == 0) {
+        DEBUG_LOG("Handed listening socket to successor, draining");
+        close(sockfd);
+        sockfd = -1;
+        draining = true;
+        drain_deadline = tw_now(&wheel) + tw_ms_to_ticks(DRAIN_TIMEOUT_S * 1000ull);
+        // the successor accepts and writes the timestamps from now on
+        pollfds[1].fd = -1;
+        pollfds[2].fd = -1;
+        // subscribers reconnect to the successor, which now sees the appends
+        ns_end_subscriptions(&registry);
+      } else {
+        ERROR_LOG("Hot upgrade handoff failed: %s", strerror(errno));
+        if(ctlfd == -1) ctlfd = handoff_listen(HANDOFF_PATH);
+      }
+      pollfds[4].fd = ctlfd;
     }
 
     // new connection
@@ -167,6 +325,8 @@ int main(int argc, char** argv){
         continue;
       }
 
+      configure_client_socket(clientfd, &cfg);
+
       // get client IP
       char ipaddr[INET_ADDRSTRLEN] = {0};
       inet_ntop(AF_INET, &client_sa.sin_addr, ipaddr, sizeof(ipaddr));
@@ -174,15 +334,28 @@ int main(int argc, char** argv){
       DEBUG_LOG("Accepted connection...");
 
       // spawn worker
-      DEBUG_LOG("Spawning worker thread...");
       struct thread_arg_t* arg = calloc(1, sizeof(thread_arg_t));
-      node_t* tid_item = calloc(1, sizeof(node_t));
       arg->shutdownfd = shutdownfd;
       arg->sockfd = clientfd;
+      arg->registry = &registry;
+      arg->wheel = &wheel;
+      arg->config = &cfg;
+      arg->capture = capture;
+
+      if(sched) {
+        DEBUG_LOG("Spawning worker coroutine...");
+        if(co_spawn(sched, conn_proc, arg) == -1) {
+          ERROR_LOG("co_spawn failed: %s", strerror(errno));
+          free(arg);
+          close(clientfd);
+        }
+        continue;
+      }
+
+      DEBUG_LOG("Spawning worker thread...");
+      node_t* tid_item = calloc(1, sizeof(node_t));
       arg->completed = &tid_item->completed;
-      arg->outfile = outfile;
-      arg->lock = &outfd_lock;
-      int ret = pthread_create(&tid_item->tid, NULL, thread_proc, arg);
+      int ret = pthread_create(&tid_item->tid, &worker_attr, thread_proc, arg);
       if (ret != 0) {
         ERROR_LOG("pthread_create failed: %s", strerror(ret));
         free(arg);
@@ -204,13 +377,15 @@ int main(int argc, char** argv){
   } // end event loop
 
   // broadcast to all workers to shutdown
-  uint32_t val = 1;
+  uint64_t val = 1; // eventfd only accepts 8 byte writes
   write(shutdownfd, &val, sizeof(val));
   DEBUG_LOG("Broadcasting shutdown to worker threads from main thread");
 
   // All threads have been signaled to shutdown...safe to join them 
   // to cleanup properly. This should not hang. All list nodes deleted
   free_all_threads(&tid_list);
+  co_sched_destroy(sched);
+  pthread_attr_destroy(&worker_attr);
 
   DEBUG_LOG("Shutting down server");
   ret_val = EXIT_SUCCESS;
@@ -223,7 +398,15 @@ int main(int argc, char** argv){
     if(sigfd != -1) close(sigfd);
     if(sockfd != -1) close(sockfd);
     if(shutdownfd != -1) close(shutdownfd);
-    if(outfile) fclose(outfile);
+    if(timerfd != -1) close(timerfd);
+    if(tickfd != -1) close(tickfd);
+    if(ctlfd != -1) {
+      close(ctlfd);
+      unlink(HANDOFF_PATH);
+    }
+    if(registry_ready) ns_registry_destroy(&registry);
+    capture_close(capture);
+    tw_destroy(&wheel);
     closelog(); 
 
     return ret_val; 
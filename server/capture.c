@@ -0,0 +1,76 @@
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "capture.h"
+#include "utility.h"
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+capture_t* capture_open(const char* path) {
+  capture_t* cap = calloc(1, sizeof(capture_t));
+  if(!cap) return NULL;
+
+  if((cap->file = fopen(path, "we")) == NULL) {
+    ERROR_LOG("Failed to open capture %s: %s", path, strerror(errno));
+    free(cap);
+    return NULL;
+  }
+  // flushed now so a daemonizing fork doesn't write it twice
+  if(fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), cap->file) != strlen(CAPTURE_MAGIC) ||
+     fflush(cap->file) != 0) {
+    ERROR_LOG("Failed to write capture %s: %s", path, strerror(errno));
+    fclose(cap->file);
+    free(cap);
+    return NULL;
+  }
+  pthread_mutex_init(&cap->lock, NULL);
+  cap->start_us = now_us();
+  atomic_init(&cap->next_conn, 1);
+  return cap;
+}
+
+void capture_close(capture_t* cap) {
+  if(!cap) return;
+  fclose(cap->file);
+  pthread_mutex_destroy(&cap->lock);
+  free(cap);
+}
+
+// records are buffered by stdio, the lock keeps header and payload together
+static void write_record(capture_t* cap, uint8_t type, uint32_t conn, const char* buf, size_t len) {
+  capture_record_t rec = {
+    .type = type,
+    .conn = htole32(conn),
+    .t_us = htole64(now_us() - cap->start_us),
+    .len = htole32(len)
+  };
+  pthread_mutex_lock(&cap->lock);
+  fwrite(&rec, sizeof(rec), 1, cap->file);
+  if(len) fwrite(buf, 1, len, cap->file);
+  pthread_mutex_unlock(&cap->lock);
+}
+
+// Record a new connection and return its id.  All capture_conn_*()
+// functions do nothing when @cap is NULL
+uint32_t capture_conn_open(capture_t* cap) {
+  if(!cap) return 0;
+  uint32_t conn = atomic_fetch_add(&cap->next_conn, 1);
+  write_record(cap, CAPTURE_OPEN, conn, NULL, 0);
+  return conn;
+}
+
+void capture_conn_data(capture_t* cap, uint32_t conn, const char* buf, size_t len) {
+  if(!cap) return;
+  write_record(cap, CAPTURE_DATA, conn, buf, len);
+}
+
+void capture_conn_close(capture_t* cap, uint32_t conn) {
+  if(!cap) return;
+  write_record(cap, CAPTURE_CLOSE, conn, NULL, 0);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Traffic capture file: the 8 byte magic followed by records, each a
+// capture_record_t header plus len payload bytes (DATA records only).
+// Times are microseconds since the capture started, integers little endian.
+#define CAPTURE_MAGIC "AESDCAP1"
+
+enum { CAPTURE_OPEN = 1, CAPTURE_DATA = 2, CAPTURE_CLOSE = 3 };
+
+typedef struct __attribute__((packed)) capture_record_t {
+  uint8_t type;
+  uint32_t conn;   // connection id, unique within the capture
+  uint64_t t_us;
+  uint32_t len;    // payload length
+} capture_record_t;
+
+typedef struct capture_t {
+  pthread_mutex_t lock;
+  FILE* file;
+  uint64_t start_us;
+  atomic_uint next_conn;
+} capture_t;
+
+capture_t* capture_open(const char* path);
+void capture_close(capture_t* cap);
+uint32_t capture_conn_open(capture_t* cap);
+void capture_conn_data(capture_t* cap, uint32_t conn, const char* buf, size_t len);
+void capture_conn_close(capture_t* cap, uint32_t conn);
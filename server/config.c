@@ -0,0 +1,257 @@
+#define _GNU_SOURCE // for cpu_set_t
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "config.h"
+#include "utility.h"
+
+const char* DEFAULT_CONFIG_PATH = "/etc/aesdsocket.conf";
+
+void config_defaults(server_config_t* cfg) {
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->port = 9000;
+  cfg->backlog = 5;
+  cfg->max_namespaces = 64;
+  cfg->timeouts.idle_s = 30;
+  cfg->timeouts.header_s = 10;
+  cfg->timeouts.request_s = 60;
+  cfg->coroutine_stack = 64 << 10;
+  cfg->stream_threshold = 1 << 20;
+  cfg->subscriber_lag = 4 << 20;
+}
+
+static int parse_int(const char* value, int min, int max, int* out) {
+  char* end;
+  errno = 0;
+  long v = strtol(value, &end, 10);
+  if(end == value || *end != '\0' || errno != 0 || v < min || v > max) return -1;
+  *out = v;
+  return 0;
+}
+
+static int parse_bool(const char* value, bool* out) {
+  if(!strcmp(value, "1") || !strcmp(value, "yes") || !strcmp(value, "true") || !strcmp(value, "on")) {
+    *out = true;
+  } else if(!strcmp(value, "0") || !strcmp(value, "no") || !strcmp(value, "false") || !strcmp(value, "off")) {
+    *out = false;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// "0,2-3" -> CPUs 0, 2 and 3
+static int parse_cpus(const char* value, cpu_set_t* set, bool* is_set) {
+  CPU_ZERO(set);
+  const char* p = value;
+  while(*p) {
+    char* end;
+    long lo = strtol(p, &end, 10);
+    long hi = lo;
+    if(end == p || lo < 0) return -1;
+    if(*end == '-') {
+      p = end + 1;
+      hi = strtol(p, &end, 10);
+      if(end == p || hi < lo) return -1;
+    }
+    if(hi >= CPU_SETSIZE) return -1;
+    for(long cpu = lo; cpu <= hi; cpu++) CPU_SET(cpu, set);
+    if(*end == ',') end++;
+    else if(*end != '\0') return -1;
+    p = end;
+  }
+  *is_set = CPU_COUNT(set) > 0;
+  return *is_set ? 0 : -1;
+}
+
+static int parse_unsigned(const char* value, unsigned* out) {
+  int v;
+  if(parse_int(value, 0, INT_MAX, &v) == -1) return -1;
+  *out = v;
+  return 0;
+}
+
+static int parse_path(const char* value, char* out, size_t size) {
+  if(strlen(value) >= size) return -1;
+  strcpy(out, value);
+  return 0;
+}
+
+// Set configuration @key to @value.  Returns 0 on success, -1 on error
+int config_set(server_config_t* cfg, const char* key, const char* value) {
+  int ret = -1;
+  if(!strcmp(key, "port")) ret = parse_int(value, 1, 65535, &cfg->port);
+  else if(!strcmp(key, "backlog")) ret = parse_int(value, 1, INT_MAX, &cfg->backlog);
+  else if(!strcmp(key, "rcvbuf")) ret = parse_int(value, 0, INT_MAX, &cfg->rcvbuf);
+  else if(!strcmp(key, "sndbuf")) ret = parse_int(value, 0, INT_MAX, &cfg->sndbuf);
+  else if(!strcmp(key, "tcp_nodelay")) ret = parse_bool(value, &cfg->tcp_nodelay);
+  else if(!strcmp(key, "tcp_cork")) ret = parse_bool(value, &cfg->tcp_cork);
+  else if(!strcmp(key, "defer_accept")) ret = parse_int(value, 0, INT_MAX, &cfg->defer_accept_s);
+  else if(!strcmp(key, "busy_poll")) ret = parse_int(value, 0, INT_MAX, &cfg->busy_poll_us);
+  else if(!strcmp(key, "accept_cpus")) ret = parse_cpus(value, &cfg->accept_cpus, &cfg->accept_cpus_set);
+  else if(!strcmp(key, "worker_cpus")) ret = parse_cpus(value, &cfg->worker_cpus, &cfg->worker_cpus_set);
+  else if(!strcmp(key, "namespaces")) ret = parse_bool(value, &cfg->namespaces);
+  else if(!strcmp(key, "max_namespaces")) ret = parse_int(value, 0, 4096, &cfg->max_namespaces);
+  else if(!strcmp(key, "persistent")) ret = parse_bool(value, &cfg->persistent);
+  else if(!strcmp(key, "idle_timeout")) ret = parse_unsigned(value, &cfg->timeouts.idle_s);
+  else if(!strcmp(key, "header_timeout")) ret = parse_unsigned(value, &cfg->timeouts.header_s);
+  else if(!strcmp(key, "request_timeout")) ret = parse_unsigned(value, &cfg->timeouts.request_s);
+  else if(!strcmp(key, "coroutines")) ret = parse_int(value, 0, 1024, &cfg->coroutines);
+  else if(!strcmp(key, "capture")) ret = parse_path(value, cfg->capture_path, sizeof(cfg->capture_path));
+  else if(!strcmp(key, "coroutine_stack")) ret = parse_int(value, 16 << 10, 64 << 20, &cfg->coroutine_stack);
+  else if(!strcmp(key, "stream_threshold")) ret = parse_int(value, 4 << 10, INT_MAX, &cfg->stream_threshold);
+  else if(!strcmp(key, "subscriptions")) ret = parse_bool(value, &cfg->subscriptions);
+  else if(!strcmp(key, "subscriber_lag")) ret = parse_int(value, 4 << 10, INT_MAX, &cfg->subscriber_lag);
+  else {
+    ERROR_LOG("Unknown config key \"%s\"", key);
+    return -1;
+  }
+
+  if(ret == -1) ERROR_LOG("Invalid value \"%s\" for %s", value, key);
+  return ret;
+}
+
+static char* trim(char* s) {
+  while(isspace((unsigned char)*s)) s++;
+  char* end = s + strlen(s);
+  while(end > s && isspace((unsigned char)end[-1])) *--end = '\0';
+  return s;
+}
+
+// Apply the "key = value" lines of @path.  Returns 0 on success, -1 on error
+int config_load_file(server_config_t* cfg, const char* path) {
+  FILE* f = fopen(path, "r");
+  if(!f) {
+    ERROR_LOG("Failed to open config %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  int ret = 0;
+  char* line = NULL;
+  size_t cap = 0;
+  int lineno = 0;
+  while(getline(&line, &cap, f) != -1) {
+    lineno++;
+    char* hash = strchr(line, '#');
+    if(hash) *hash = '\0';
+    char* key = trim(line);
+    if(*key == '\0') continue;
+
+    char* eq = strchr(key, '=');
+    if(eq == NULL) {
+      ERROR_LOG("%s:%d: expected \"key = value\"", path, lineno);
+      ret = -1;
+      continue;
+    }
+    *eq = '\0';
+    if(config_set(cfg, trim(key), trim(eq + 1)) == -1) {
+      ERROR_LOG("%s:%d: invalid setting", path, lineno);
+      ret = -1;
+    }
+  }
+
+  free(line);
+  fclose(f);
+  return ret;
+}
+
+static const struct option LONG_OPTIONS[] = {
+  {"config", required_argument, NULL, 'c'},
+  {"port", required_argument, NULL, 0},
+  {"backlog", required_argument, NULL, 0},
+  {"rcvbuf", required_argument, NULL, 0},
+  {"sndbuf", required_argument, NULL, 0},
+  {"tcp-nodelay", required_argument, NULL, 0},
+  {"tcp-cork", required_argument, NULL, 0},
+  {"defer-accept", required_argument, NULL, 0},
+  {"busy-poll", required_argument, NULL, 0},
+  {"accept-cpus", required_argument, NULL, 0},
+  {"worker-cpus", required_argument, NULL, 0},
+  {"namespaces", required_argument, NULL, 0},
+  {"max-namespaces", required_argument, NULL, 0},
+  {"persistent", required_argument, NULL, 0},
+  {"idle-timeout", required_argument, NULL, 'I'},
+  {"header-timeout", required_argument, NULL, 'H'},
+  {"request-timeout", required_argument, NULL, 'T'},
+  {"coroutines", required_argument, NULL, 0},
+  {"coroutine-stack", required_argument, NULL, 0},
+  {"capture", required_argument, NULL, 0},
+  {"stream-threshold", required_argument, NULL, 0},
+  {"subscriptions", required_argument, NULL, 0},
+  {"subscriber-lag", required_argument, NULL, 0},
+  {0, 0, 0, 0}
+};
+static const char* SHORT_OPTIONS = "c:dnupI:H:T:";
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [-c config] [-d] [-n] [-u] [-p] [-I idle_s] [-H header_s] [-T request_s]\n"
+          "          [--port=N] [--backlog=N] [--rcvbuf=bytes] [--sndbuf=bytes]\n"
+          "          [--tcp-nodelay=0|1] [--tcp-cork=0|1] [--defer-accept=s] [--busy-poll=us]\n"
+          "          [--accept-cpus=list] [--worker-cpus=list]\n"
+          "          [--namespaces=0|1] [--max-namespaces=N] [--persistent=0|1]\n"
+          "          [--coroutines=threads] [--coroutine-stack=bytes] [--capture=file]\n"
+          "          [--stream-threshold=bytes] [--subscriptions=0|1] [--subscriber-lag=bytes]\n",
+          prog);
+}
+
+// Load the config file (-c, or DEFAULT_CONFIG_PATH when it exists) and then
+// apply the command line on top of it.  Returns 0 on success, -1 on error
+int config_parse_args(server_config_t* cfg, int argc, char** argv) {
+  const char* path = NULL;
+  int opt;
+
+  // first pass only looks for the config file
+  opterr = 0;
+  while((opt = getopt_long(argc, argv, SHORT_OPTIONS, LONG_OPTIONS, NULL)) != -1) {
+    if(opt == 'c') path = optarg;
+  }
+  if(path) {
+    if(config_load_file(cfg, path) == -1) return -1;
+  } else if(access(DEFAULT_CONFIG_PATH, F_OK) == 0) {
+    if(config_load_file(cfg, DEFAULT_CONFIG_PATH) == -1) return -1;
+  }
+
+  opterr = 1;
+  optind = 0; // full getopt reset
+  int index;
+  while((opt = getopt_long(argc, argv, SHORT_OPTIONS, LONG_OPTIONS, &index)) != -1) {
+    int ret = 0;
+    switch(opt) {
+      case 'c': break;
+      case 'd': cfg->daemon = true; break;
+      case 'n': cfg->namespaces = true; break;
+      case 'u': cfg->upgrade = true; break;
+      case 'p': cfg->persistent = true; break;
+      case 'I': ret = config_set(cfg, "idle_timeout", optarg); break;
+      case 'H': ret = config_set(cfg, "header_timeout", optarg); break;
+      case 'T': ret = config_set(cfg, "request_timeout", optarg); break;
+      case 0: {
+        // long option names are the config keys with '-' for '_'
+        char key[32];
+        snprintf(key, sizeof(key), "%s", LONG_OPTIONS[index].name);
+        for(char* p = key; *p; p++) if(*p == '-') *p = '_';
+        ret = config_set(cfg, key, optarg);
+        break;
+      }
+      default:
+        ret = -1;
+        break;
+    }
+    if(ret == -1) {
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if(optind != argc) {
+    usage(argv[0]);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <sched.h>
+#include <stdbool.h>
+
+// Per connection deadlines in seconds, 0 disables a deadline
+typedef struct conn_timeouts_t {
+  unsigned idle_s;     // no bytes received or sent for this long
+  unsigned header_s;   // first byte of the request must arrive within
+  unsigned request_s;  // whole request, up to '\n', and its reply must be done within
+} conn_timeouts_t;
+
+// Server settings.  Defaults are overridden by the config file, which is
+// overridden by the command line.  The file holds "key = value" lines, '#'
+// starts a comment; every key is also accepted as --key=value (with '-'
+// instead of '_').  Socket sizes and times of 0 keep the kernel default.
+typedef struct server_config_t {
+  int port;               // port
+  int backlog;            // backlog: listen() queue length
+  int rcvbuf;             // rcvbuf: SO_RCVBUF bytes
+  int sndbuf;             // sndbuf: SO_SNDBUF bytes
+  bool tcp_nodelay;       // tcp_nodelay: disable Nagle on client sockets
+  bool tcp_cork;          // tcp_cork: cork each reply so it leaves in full segments
+  int defer_accept_s;     // defer_accept: TCP_DEFER_ACCEPT seconds
+  int busy_poll_us;       // busy_poll: SO_BUSY_POLL microseconds
+  bool accept_cpus_set;
+  cpu_set_t accept_cpus;  // accept_cpus: CPU list for the accept thread, e.g. "0,2-3"
+  bool worker_cpus_set;
+  cpu_set_t worker_cpus;  // worker_cpus: CPU list for worker threads
+  bool namespaces;        // namespaces (-n)
+  int max_namespaces;     // max_namespaces: further new tags go to the default log
+  bool persistent;        // persistent (-p)
+  conn_timeouts_t timeouts;  // idle_timeout (-I), header_timeout (-H), request_timeout (-T)
+  int coroutines;         // coroutines: scheduler threads, 0 for a thread per connection
+  int coroutine_stack;    // coroutine_stack: stack bytes per connection
+  char capture_path[256]; // capture: record all traffic to this file, "" for off
+  int stream_threshold;   // stream_threshold: bytes buffered in memory before a message spills to disk
+  bool subscriptions;     // subscriptions: accept "!subscribe" requests
+  int subscriber_lag;     // subscriber_lag: bytes a subscriber may fall behind before it is dropped
+  bool daemon;            // -d, command line only
+  bool upgrade;           // -u, command line only
+} server_config_t;
+
+extern const char* DEFAULT_CONFIG_PATH;
+
+void config_defaults(server_config_t* cfg);
+int config_set(server_config_t* cfg, const char* key, const char* value);
+int config_load_file(server_config_t* cfg, const char* path);
+int config_parse_args(server_config_t* cfg, int argc, char** argv);
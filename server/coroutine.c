@@ -0,0 +1,403 @@
+#define _GNU_SOURCE // for pthread_attr_setaffinity_np()
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "coroutine.h"
+#include "utility.h"
+
+enum { MAX_EVENTS = 64, MIN_STACK_SIZE = 16 << 10, SLAB_STACKS = 64 };
+
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102 // Linux 6.13, older headers lack it
+#endif
+
+typedef struct co_worker_t co_worker_t;
+
+typedef struct coroutine_t {
+  ucontext_t ctx;
+  void* stack;              // lowest usable byte, above the guard page
+  co_fn_t fn;
+  void* arg;
+  co_worker_t* worker;
+  bool waiting;             // parked in co_poll()
+  bool done;
+  struct coroutine_t* next; // run queue or inbox link
+  struct coroutine_t* wait_prev;  // waiting list links
+  struct coroutine_t* wait_next;
+} coroutine_t;
+
+struct co_worker_t {
+  co_sched_t* sched;
+  pthread_t tid;
+  int epfd;
+  int wakefd;               // eventfd signalled by co_spawn()
+  ucontext_t sched_ctx;
+  coroutine_t* ready_head;  // run queue, only touched by this thread
+  coroutine_t* ready_tail;
+  coroutine_t* waiting;     // parked coroutines, woken on shutdown
+  size_t live;
+  bool stopping;
+  pthread_mutex_t inbox_lock;
+  coroutine_t* inbox;       // spawned by other threads, not started yet
+};
+
+// A mapping carved into SLAB_STACKS stacks, each above its own guard page.
+// Every mapping counts against vm.max_map_count (65530 by default), so
+// stacks are not mapped one by one
+typedef struct co_slab_t {
+  struct co_slab_t* next;
+  void* map;
+  size_t map_size;
+  coroutine_t cos[SLAB_STACKS];
+} co_slab_t;
+
+struct co_sched_t {
+  int nthreads;
+  size_t stack_size;        // usable bytes, a multiple of the page size
+  int shutdownfd;
+  atomic_uint next_worker;
+  atomic_size_t count;      // coroutines spawned and not yet finished
+  co_worker_t* workers;
+  pthread_mutex_t pool_lock;
+  coroutine_t* pool;        // finished coroutines, their stacks are reused
+  co_slab_t* slabs;
+};
+
+// epoll data of the two per worker fds, everything else is a coroutine
+static char WAKE_TAG, SHUTDOWN_TAG;
+
+static __thread coroutine_t* current_co;
+
+static void push_ready(co_worker_t* w, coroutine_t* co) {
+  co->next = NULL;
+  if(w->ready_tail) {
+    w->ready_tail->next = co;
+  } else {
+    w->ready_head = co;
+  }
+  w->ready_tail = co;
+}
+
+static void wake(co_worker_t* w, coroutine_t* co) {
+  if(!co->waiting) return; // several of its fds fired
+  co->waiting = false;
+  if(co->wait_prev) co->wait_prev->wait_next = co->wait_next;
+  else w->waiting = co->wait_next;
+  if(co->wait_next) co->wait_next->wait_prev = co->wait_prev;
+  co->wait_prev = co->wait_next = NULL;
+  push_ready(w, co);
+}
+
+static void trampoline(void) {
+  coroutine_t* co = current_co;
+  co->fn(co->arg);
+  co->done = true;
+  // uc_link is not used, the scheduler frees the stack we are running on
+  swapcontext(&co->ctx, &co->worker->sched_ctx);
+}
+
+// Point @co's context at trampoline() on its own stack.  Kept apart from
+// co_create() so no local of the caller is live across getcontext(), which
+// returns twice as far as the compiler knows
+static void init_context(coroutine_t* co, size_t stack_size) {
+  getcontext(&co->ctx);
+  co->ctx.uc_stack.ss_sp = co->stack;
+  co->ctx.uc_stack.ss_size = stack_size;
+  co->ctx.uc_link = NULL;
+  makecontext(&co->ctx, trampoline, 0);
+}
+
+// Map another slab and put its coroutines in the pool.  Called with
+// pool_lock held
+static int add_slab(co_sched_t* sched) {
+  long page = sysconf(_SC_PAGESIZE);
+  size_t slot = sched->stack_size + page;
+  co_slab_t* slab = calloc(1, sizeof(co_slab_t));
+  if(!slab) return -1;
+  slab->map_size = slot * SLAB_STACKS;
+  slab->map = mmap(NULL, slab->map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if(slab->map == MAP_FAILED) {
+    free(slab);
+    return -1;
+  }
+
+  for(int i = 0; i < SLAB_STACKS; i++) {
+    char* guard = (char*)slab->map + i * slot;
+    // the lowest page of a slot faults on overflow instead of corrupting the
+    // stack below.  A guard region keeps the slab a single mapping; the
+    // mprotect() fallback for older kernels splits it in two per stack
+    if(madvise(guard, page, MADV_GUARD_INSTALL) == -1 &&
+       mprotect(guard, page, PROT_NONE) == -1) {
+      munmap(slab->map, slab->map_size);
+      free(slab);
+      return -1;
+    }
+    coroutine_t* co = &slab->cos[i];
+    co->stack = guard + page;
+    co->next = sched->pool;
+    sched->pool = co;
+  }
+  slab->next = sched->slabs;
+  sched->slabs = slab;
+  return 0;
+}
+
+static coroutine_t* co_create(co_sched_t* sched, co_fn_t fn, void* arg) {
+  pthread_mutex_lock(&sched->pool_lock);
+  if(!sched->pool && add_slab(sched) == -1) {
+    pthread_mutex_unlock(&sched->pool_lock);
+    return NULL;
+  }
+  coroutine_t* co = sched->pool;
+  sched->pool = co->next;
+  pthread_mutex_unlock(&sched->pool_lock);
+
+  void* stack = co->stack;
+  memset(co, 0, sizeof(coroutine_t));
+  co->stack = stack;
+  init_context(co, sched->stack_size);
+  co->fn = fn;
+  co->arg = arg;
+  return co;
+}
+
+// Return @co to the pool.  The kernel may reclaim the stack's pages until
+// it is used again, so a burst of connections does not pin its memory
+static void co_free(co_sched_t* sched, coroutine_t* co) {
+  madvise(co->stack, sched->stack_size, MADV_FREE);
+  pthread_mutex_lock(&sched->pool_lock);
+  co->next = sched->pool;
+  sched->pool = co;
+  pthread_mutex_unlock(&sched->pool_lock);
+}
+
+// Start @fn(@arg) as a coroutine.  Safe to call from any thread
+int co_spawn(co_sched_t* sched, co_fn_t fn, void* arg) {
+  coroutine_t* co = co_create(sched, fn, arg);
+  if(!co) return -1;
+
+  atomic_fetch_add(&sched->count, 1);
+  unsigned i = atomic_fetch_add(&sched->next_worker, 1) % sched->nthreads;
+  co_worker_t* w = &sched->workers[i];
+  co->worker = w;
+
+  pthread_mutex_lock(&w->inbox_lock);
+  co->next = w->inbox;
+  w->inbox = co;
+  pthread_mutex_unlock(&w->inbox_lock);
+
+  uint64_t one = 1;
+  write(w->wakefd, &one, sizeof(one));
+  return 0;
+}
+
+static void drain_inbox(co_worker_t* w) {
+  uint64_t count;
+  read(w->wakefd, &count, sizeof(count));
+
+  pthread_mutex_lock(&w->inbox_lock);
+  coroutine_t* co = w->inbox;
+  w->inbox = NULL;
+  pthread_mutex_unlock(&w->inbox_lock);
+
+  while(co) {
+    coroutine_t* next = co->next;
+    w->live++;
+    push_ready(w, co);
+    co = next;
+  }
+}
+
+static void run_ready(co_worker_t* w) {
+  while(w->ready_head) {
+    coroutine_t* co = w->ready_head;
+    w->ready_head = co->next;
+    if(!w->ready_head) w->ready_tail = NULL;
+
+    current_co = co;
+    swapcontext(&w->sched_ctx, &co->ctx);
+    current_co = NULL;
+
+    if(co->done) {
+      co_free(w->sched, co);
+      w->live--;
+      atomic_fetch_sub(&w->sched->count, 1);
+    }
+  }
+}
+
+static void* worker_loop(void* arg) {
+  co_worker_t* w = arg;
+  struct epoll_event events[MAX_EVENTS];
+
+  while(true) {
+    run_ready(w);
+    if(w->stopping && w->live == 0) {
+      pthread_mutex_lock(&w->inbox_lock);
+      bool idle = w->inbox == NULL;
+      pthread_mutex_unlock(&w->inbox_lock);
+      if(idle) break;
+    }
+
+    int n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+    if(n == -1 && errno == EINTR) continue;
+    if(n == -1) {
+      ERROR_LOG("Coroutine scheduler epoll_wait() error. %s", strerror(errno));
+      break;
+    }
+
+    for(int i = 0; i < n; i++) {
+      void* tag = events[i].data.ptr;
+      if(tag == &WAKE_TAG) {
+        drain_inbox(w);
+      } else if(tag == &SHUTDOWN_TAG) {
+        // stays readable, stop watching it and let every coroutine see it
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->sched->shutdownfd, NULL);
+        w->stopping = true;
+        while(w->waiting) wake(w, w->waiting);
+      } else {
+        wake(w, tag);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Number of coroutines that have not finished yet
+size_t co_sched_count(co_sched_t* sched) {
+  return atomic_load(&sched->count);
+}
+
+// poll() for coroutines: park until one of @fds is ready.  Outside of a
+// coroutine this is plain poll().  Inside one only timeouts of 0 and -1 are
+// supported; deadlines are enforced by shutting the socket down instead.
+int co_poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+  coroutine_t* co = current_co;
+  if(co == NULL || timeout == 0) return poll(fds, nfds, timeout);
+  if(timeout > 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  int ready = poll(fds, nfds, 0);
+  if(ready != 0) return ready;
+
+  // shutdownfd is watched by the scheduler, which wakes everybody when it
+  // fires, so it is never added to epoll here
+  co_worker_t* w = co->worker;
+  int shutdownfd = w->sched->shutdownfd;
+  for(nfds_t i = 0; i < nfds; i++) {
+    if(fds[i].fd < 0 || fds[i].fd == shutdownfd) continue;
+    struct epoll_event ev = {
+      .events = EPOLLONESHOT | ((fds[i].events & POLLIN) ? EPOLLIN : 0) |
+                ((fds[i].events & POLLOUT) ? EPOLLOUT : 0),
+      .data.ptr = co
+    };
+    if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, fds[i].fd, &ev) == -1) {
+      int err = errno;
+      for(nfds_t j = 0; j < i; j++) {
+        if(fds[j].fd >= 0 && fds[j].fd != shutdownfd) epoll_ctl(w->epfd, EPOLL_CTL_DEL, fds[j].fd, NULL);
+      }
+      errno = err;
+      return -1;
+    }
+  }
+
+  co->waiting = true;
+  co->wait_prev = NULL;
+  co->wait_next = w->waiting;
+  if(w->waiting) w->waiting->wait_prev = co;
+  w->waiting = co;
+  swapcontext(&co->ctx, &w->sched_ctx);
+
+  for(nfds_t i = 0; i < nfds; i++) {
+    if(fds[i].fd >= 0 && fds[i].fd != shutdownfd) epoll_ctl(w->epfd, EPOLL_CTL_DEL, fds[i].fd, NULL);
+  }
+  return poll(fds, nfds, 0);
+}
+
+// Create a runtime of @nthreads scheduler threads, optionally pinned to the
+// cpu_set_t @cpus.  The runtime winds down once eventfd @shutdownfd becomes
+// readable and its coroutines return.
+co_sched_t* co_sched_create(int nthreads, size_t stack_size, int shutdownfd, const void* cpus) {
+  co_sched_t* sched = calloc(1, sizeof(co_sched_t));
+  if(!sched) return NULL;
+  long page = sysconf(_SC_PAGESIZE);
+  if(stack_size < MIN_STACK_SIZE) stack_size = MIN_STACK_SIZE;
+  sched->stack_size = (stack_size + page - 1) / page * page;
+  pthread_mutex_init(&sched->pool_lock, NULL);
+  sched->shutdownfd = shutdownfd;
+  if((sched->workers = calloc(nthreads, sizeof(co_worker_t))) == NULL) {
+    pthread_mutex_destroy(&sched->pool_lock);
+    free(sched);
+    return NULL;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if(cpus) pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), cpus);
+
+  for(int i = 0; i < nthreads; i++) {
+    co_worker_t* w = &sched->workers[i];
+    w->sched = sched;
+    pthread_mutex_init(&w->inbox_lock, NULL);
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = &WAKE_TAG };
+    struct epoll_event stop_ev = { .events = EPOLLIN, .data.ptr = &SHUTDOWN_TAG };
+    if(w->epfd == -1 || w->wakefd == -1 ||
+       epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &wake_ev) == -1 ||
+       epoll_ctl(w->epfd, EPOLL_CTL_ADD, shutdownfd, &stop_ev) == -1 ||
+       pthread_create(&w->tid, &attr, worker_loop, w) != 0) {
+      ERROR_LOG("Failed to start coroutine scheduler thread: %s", strerror(errno));
+      if(w->epfd != -1) close(w->epfd);
+      if(w->wakefd != -1) close(w->wakefd);
+      pthread_mutex_destroy(&w->inbox_lock);
+      break;
+    }
+    sched->nthreads++;
+  }
+  pthread_attr_destroy(&attr);
+
+  if(sched->nthreads == 0) {
+    pthread_mutex_destroy(&sched->pool_lock);
+    free(sched->workers);
+    free(sched);
+    return NULL;
+  }
+  return sched;
+}
+
+// Wait for the scheduler threads, which return once shutdownfd was
+// signalled and all their coroutines finished, then free the runtime
+void co_sched_destroy(co_sched_t* sched) {
+  if(!sched) return;
+  for(int i = 0; i < sched->nthreads; i++) {
+    co_worker_t* w = &sched->workers[i];
+    pthread_join(w->tid, NULL);
+
+    close(w->epfd);
+    close(w->wakefd);
+    pthread_mutex_destroy(&w->inbox_lock);
+  }
+  while(sched->slabs) {
+    co_slab_t* slab = sched->slabs;
+    sched->slabs = slab->next;
+    munmap(slab->map, slab->map_size);
+    free(slab);
+  }
+  pthread_mutex_destroy(&sched->pool_lock);
+  free(sched->workers);
+  free(sched);
+}
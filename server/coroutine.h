@@ -0,0 +1,21 @@
+#pragma once
+#include <poll.h>
+#include <stddef.h>
+
+// M:N coroutine runtime.  Coroutines run on a few scheduler threads, each
+// with a small stack carved from a pooled mapping, so a connection costs
+// kilobytes instead of a thread.  Code inside a coroutine stays sequential: co_poll() parks the
+// coroutine until one of its fds is ready and runs others meanwhile.
+//
+// A coroutine never migrates between scheduler threads.  Blocking calls
+// other than co_poll() (mutexes, file I/O) block the whole scheduler thread,
+// so they must be short.
+
+typedef struct co_sched_t co_sched_t;
+typedef void (*co_fn_t)(void* arg);
+
+co_sched_t* co_sched_create(int nthreads, size_t stack_size, int shutdownfd, const void* cpus);
+void co_sched_destroy(co_sched_t* sched);
+int co_spawn(co_sched_t* sched, co_fn_t fn, void* arg);
+size_t co_sched_count(co_sched_t* sched);
+int co_poll(struct pollfd* fds, nfds_t nfds, int timeout);
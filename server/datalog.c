@@ -0,0 +1,304 @@
+#define _GNU_SOURCE // for asprintf()
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "datalog.h"
+#include "utility.h"
+
+// the index checkpoint of "<dir>/<file>" is "<dir>/.<file>.idx", which
+// cannot clash with a namespace file
+static char* make_index_path(const char* path) {
+  char* dir_copy = strdup(path);
+  char* base_copy = strdup(path);
+  char* index_path = NULL;
+  if(dir_copy && base_copy &&
+     asprintf(&index_path, "%s/.%s.idx", dirname(dir_copy), basename(base_copy)) == -1) {
+    index_path = NULL;
+  }
+  free(dir_copy);
+  free(base_copy);
+  return index_path;
+}
+
+// Rebuild the index of a kept log, from the checkpoint where possible
+static int load_history(datalog_t* log, log_open_mode_t mode) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  off_t size;
+  if(mode == LOG_RECOVER) {
+    size = log_recover_tail(log->fd);
+  } else {
+    // the draining server may be halfway through a record, see lock_log()
+    struct stat st;
+    if(flock(log->fd, LOCK_EX) == -1) return -1;
+    size = fstat(log->fd, &st) == 0 ? st.st_size : -1;
+    flock(log->fd, LOCK_UN);
+  }
+  if(size == -1) return -1;
+
+  bool from_checkpoint = log_index_load(&log->index, log->index_path, log->fd) == 0;
+  off_t checkpointed = log->index.length;
+  if(log_index_scan(&log->index, log->fd, size) == -1) return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  DEBUG_LOG("Loaded %s: %llu lines, %lld bytes (%lld from checkpoint) in %.3f s",
+            log->path, (unsigned long long)log->index.count, (long long)log->index.length,
+            from_checkpoint ? (long long)checkpointed : 0LL,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  return 0;
+}
+
+datalog_t* datalog_open(const char* path, const char* name, log_open_mode_t mode) {
+  datalog_t* log = calloc(1, sizeof(datalog_t));
+  if(!log) return NULL;
+  log->fd = -1;
+
+  if((log->name = strdup(name)) == NULL || (log->path = strdup(path)) == NULL ||
+     (log->index_path = make_index_path(path)) == NULL) {
+    goto fail;
+  }
+
+  int flags = O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | (mode == LOG_TRUNCATE ? O_TRUNC : 0);
+  if((log->fd = open(path, flags, 0644)) == -1) {
+    ERROR_LOG("Failed to open %s: %s", path, strerror(errno));
+    goto fail;
+  }
+
+  if(mode == LOG_TRUNCATE) {
+    // a checkpoint of the old contents must never describe the new ones
+    unlink(log->index_path);
+    free(log->index_path);
+    log->index_path = NULL;
+  } else if(load_history(log, mode) == -1) {
+    ERROR_LOG("Failed to load %s: %s", path, strerror(errno));
+    goto fail;
+  }
+
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_mutex_init(&log->subs_lock, NULL);
+  atomic_init(&log->appends, 0);
+  atomic_init(&log->notifying, false);
+  return log;
+
+fail:
+  if(log->fd != -1) close(log->fd);
+  log_index_free(&log->index);
+  free(log->index_path);
+  free(log->path);
+  free(log->name);
+  free(log);
+  return NULL;
+}
+
+void datalog_close(datalog_t* log) {
+  if(!log) return;
+  if(log->index_path && log_index_save(&log->index, log->index_path, log->fd) == -1) {
+    ERROR_LOG("Failed to save checkpoint %s: %s", log->index_path, strerror(errno));
+  }
+  close(log->fd);
+  pthread_mutex_destroy(&log->lock);
+  pthread_mutex_destroy(&log->subs_lock);
+  log_index_free(&log->index);
+  free(log->index_path);
+  free(log->path);
+  free(log->name);
+  free(log);
+}
+
+// Appends and size queries also hold an flock() on the file.  During a hot
+// upgrade the new server opens the log itself and appends while the old one
+// drains, and a record written in several write()s must neither interleave
+// with the other process's nor be counted before it is complete.  Threads
+// share the open file, so log->lock still orders them and is taken first
+static int lock_log(datalog_t* log) {
+  pthread_mutex_lock(&log->lock);
+  while(flock(log->fd, LOCK_EX) == -1) {
+    if(errno == EINTR) continue;
+    ERROR_LOG("Failed to lock %s: %s", log->path, strerror(errno));
+    pthread_mutex_unlock(&log->lock);
+    return -1;
+  }
+  return 0;
+}
+
+static void unlock_log(datalog_t* log) {
+  flock(log->fd, LOCK_UN);
+  pthread_mutex_unlock(&log->lock);
+}
+
+// write() all of @buf, retrying on short writes
+static int write_all(int fd, const char* buf, size_t len) {
+  while(len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if(n == -1 && errno == EINTR) continue;
+    if(n == -1) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Wake every subscriber after an append, with log->lock released so the
+// next append does not wait for the fan-out.  One thread at a time walks the
+// list; appends made meanwhile only bump the counter, and the walking thread
+// goes round again until no append slipped in behind its snapshot
+static void notify_subscribers(datalog_t* log) {
+  atomic_fetch_add(&log->appends, 1);
+  while(!atomic_exchange(&log->notifying, true)) {
+    uint_fast64_t snapshot = atomic_load(&log->appends);
+    uint64_t one = 1;
+    pthread_mutex_lock(&log->subs_lock);
+    for(datalog_sub_t* sub = log->subs; sub != NULL; sub = sub->next) {
+      // a full counter already means "readable", nothing lost
+      if(write(sub->fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        ERROR_LOG("Failed to notify subscriber of %s: %s", log->path, strerror(errno));
+      }
+    }
+    pthread_mutex_unlock(&log->subs_lock);
+    atomic_store(&log->notifying, false);
+    if(atomic_load(&log->appends) == snapshot) break;
+  }
+}
+
+// Append a complete record to the log.  Returns 0 on success, -1 on error
+int datalog_append(datalog_t* log, const char* buf, size_t len) {
+  if(lock_log(log) == -1) return -1;
+  int ret = write_all(log->fd, buf, len);
+  if(ret == 0 && log->index_path) {
+    // O_APPEND leaves the offset at the end of what we just wrote.  Anything
+    // before that the index hasn't seen was appended by another process
+    off_t start = lseek(log->fd, 0, SEEK_CUR) - len;
+    if(start > log->index.length) log_index_scan(&log->index, log->fd, start);
+    log_index_add(&log->index, start, buf, len);
+  }
+  unlock_log(log);
+  if(ret == 0) notify_subscribers(log);
+  return ret;
+}
+
+// Append the @len bytes at @offset of file @fd as one record.  Used for
+// messages too large to hold in memory; the copy goes through a bounded
+// buffer with the log locked, so no reader sees part of the record and no
+// other process appends into the middle of it.  A failed copy is cut off
+// again.  Returns 0 on success, -1 on
+// error
+int datalog_append_fd(datalog_t* log, int fd, off_t offset, size_t len) {
+  char* buf = malloc(DATALOG_COPY_SIZE);
+  if(!buf) return -1;
+
+  if(lock_log(log) == -1) {
+    free(buf);
+    return -1;
+  }
+  int ret = 0;
+  // taken under the file lock, so the record starts exactly here
+  struct stat st;
+  if(fstat(log->fd, &st) == -1) {
+    ret = -1;
+    goto unlock;
+  }
+  // catch up with other processes' appends before indexing chunk by chunk
+  if(log->index_path && st.st_size > log->index.length &&
+     log_index_scan(&log->index, log->fd, st.st_size) == -1) {
+    ret = -1;
+    goto unlock;
+  }
+  log_index_t saved_index = log->index;
+  off_t pos = st.st_size;
+  while(len > 0) {
+    ssize_t n = pread(fd, buf, len < DATALOG_COPY_SIZE ? len : DATALOG_COPY_SIZE, offset);
+    if(n == -1 && errno == EINTR) continue;
+    if(n <= 0 || write_all(log->fd, buf, n) == -1) {
+      if(n == 0) errno = EIO;  // source is shorter than promised
+      int saved = errno;
+      if(ftruncate(log->fd, st.st_size) == -1) {
+        ERROR_LOG("Failed to cut partial record off %s: %s", log->path, strerror(errno));
+      }
+      // forget lines of the partial record, the marks array itself is kept
+      log->index.count = saved_index.count;
+      log->index.length = saved_index.length;
+      log->index.nmarks = saved_index.nmarks;
+      errno = saved;
+      ret = -1;
+      goto unlock;
+    }
+    if(log->index_path) log_index_add(&log->index, pos, buf, n);
+    pos += n;
+    offset += n;
+    len -= n;
+  }
+unlock:
+  unlock_log(log);
+  free(buf);
+  // subscribers only hear of the record once it is complete
+  if(ret == 0) notify_subscribers(log);
+  return ret;
+}
+
+// Size of the log including every record appended so far.  Records are only
+// ever added, so the first that many bytes can be read without the lock.
+// Returns -1 on error
+off_t datalog_size(datalog_t* log) {
+  if(lock_log(log) == -1) return -1;
+  struct stat st;
+  off_t size = fstat(log->fd, &st) == 0 ? st.st_size : -1;
+  unlock_log(log);
+  return size;
+}
+
+// Start following @log.  @sub->fd becomes readable whenever a record was
+// appended.  Returns the current size, where the subscriber starts reading,
+// or -1 on error
+off_t datalog_subscribe(datalog_t* log, datalog_sub_t* sub) {
+  sub->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(sub->fd == -1) return -1;
+  atomic_init(&sub->ended, false);
+
+  // listed before the size is taken, so every append past it wakes @sub
+  pthread_mutex_lock(&log->subs_lock);
+  sub->next = log->subs;
+  log->subs = sub;
+  pthread_mutex_unlock(&log->subs_lock);
+
+  off_t size = -1;
+  if(lock_log(log) == 0) {
+    struct stat st;
+    size = fstat(log->fd, &st) == 0 ? st.st_size : -1;
+    unlock_log(log);
+  }
+  if(size == -1) datalog_unsubscribe(log, sub);
+  return size;
+}
+
+void datalog_unsubscribe(datalog_t* log, datalog_sub_t* sub) {
+  pthread_mutex_lock(&log->subs_lock);
+  for(datalog_sub_t** cur = &log->subs; *cur != NULL; cur = &(*cur)->next) {
+    if(*cur == sub) {
+      *cur = sub->next;
+      break;
+    }
+  }
+  // a notifier holds subs_lock while writing, so the fd is no longer in use
+  pthread_mutex_unlock(&log->subs_lock);
+  close(sub->fd);
+  sub->fd = -1;
+}
+
+// Ask every subscriber to disconnect.  They unsubscribe themselves
+void datalog_end_subscriptions(datalog_t* log) {
+  pthread_mutex_lock(&log->subs_lock);
+  for(datalog_sub_t* sub = log->subs; sub != NULL; sub = sub->next) {
+    atomic_store(&sub->ended, true);
+  }
+  pthread_mutex_unlock(&log->subs_lock);
+  notify_subscribers(log);
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "logindex.h"
+
+// bytes copied at a time when a record is appended from a file
+#define DATALOG_COPY_SIZE (64 << 10)
+
+// How an existing log file is treated when it is opened
+typedef enum log_open_mode_t {
+  LOG_TRUNCATE,  // start empty (default)
+  LOG_RECOVER,   // keep history, drop a partial last record left by a crash
+  LOG_CONTINUE   // keep history as is, another server may still be appending
+} log_open_mode_t;
+
+// A client following a log.  The log file itself is the buffer shared by all
+// subscribers: each keeps its own offset into it and reads what was appended
+// since, so an append only has to wake them.
+typedef struct datalog_sub_t {
+  int fd;              // eventfd, readable after every append
+  atomic_bool ended;   // the log ended the subscription, e.g. on hot upgrade
+  struct datalog_sub_t* next;
+} datalog_sub_t;
+
+// An append-only log file and the lock serializing access to it.  Every
+// namespace owns one, untagged traffic goes to the default log.  The file is
+// opened O_APPEND so a process taking over during a hot restart can append
+// to it concurrently with the one draining.
+typedef struct datalog_t {
+  char* name;     // namespace name, "" for the default log
+  char* path;
+  char* index_path;  // checkpoint of index, NULL when history is not kept
+  int fd;
+  pthread_mutex_t lock;
+  log_index_t index;  // only maintained while index_path is set
+  pthread_mutex_t subs_lock;  // never held while appending
+  datalog_sub_t* subs;        // under subs_lock
+  atomic_uint_fast64_t appends;  // bumped after every append, see notify_subscribers()
+  atomic_bool notifying;
+  struct datalog_t* next;
+} datalog_t;
+
+datalog_t* datalog_open(const char* path, const char* name, log_open_mode_t mode);
+void datalog_close(datalog_t* log);
+int datalog_append(datalog_t* log, const char* buf, size_t len);
+int datalog_append_fd(datalog_t* log, int fd, off_t offset, size_t len);
+off_t datalog_size(datalog_t* log);
+off_t datalog_subscribe(datalog_t* log, datalog_sub_t* sub);
+void datalog_unsubscribe(datalog_t* log, datalog_sub_t* sub);
+void datalog_end_subscriptions(datalog_t* log);
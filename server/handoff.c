@@ -0,0 +1,166 @@
+#define _GNU_SOURCE // for accept4()
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "handoff.h"
+#include "utility.h"
+
+// what a successor sends to ask for the listening socket
+#define HANDOFF_REQUEST 'U'
+// how long a connected peer has to send HANDOFF_REQUEST
+#define HANDOFF_REQUEST_TIMEOUT_MS 1000
+
+// the other end must run as the same user as we do
+static int check_peer(int sock) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) return -1;
+  if(cred.uid != geteuid()) {
+    ERROR_LOG("Hot upgrade peer pid %d runs as uid %d, rejected", (int)cred.pid, (int)cred.uid);
+    errno = EPERM;
+    return -1;
+  }
+  return 0;
+}
+
+// Wait for the successor's request on a freshly accepted @peer.  Anything
+// else, or nothing within the timeout, is not a successor
+static int read_request(int peer) {
+  struct pollfd pfd = { .fd = peer, .events = POLLIN };
+  int n;
+  while((n = poll(&pfd, 1, HANDOFF_REQUEST_TIMEOUT_MS)) == -1 && errno == EINTR) {
+  }
+  if(n == 0) errno = ETIMEDOUT;
+  if(n <= 0) return -1;
+
+  char byte;
+  ssize_t r;
+  while((r = recv(peer, &byte, 1, MSG_DONTWAIT)) == -1 && errno == EINTR) {
+  }
+  if(r == 1 && byte == HANDOFF_REQUEST) return 0;
+  if(r != -1) errno = EPROTO;
+  return -1;
+}
+
+static int fill_addr(struct sockaddr_un* sa, const char* path) {
+  memset(sa, 0, sizeof(*sa));
+  sa->sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(sa->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(sa->sun_path, path);
+  return 0;
+}
+
+// Create the control socket at @path, replacing a stale one.  Only call this
+// once the TCP port is ours, so no live server can own @path.  @path must be
+// in a directory only we can write to, the socket itself is made private.
+int handoff_listen(const char* path) {
+  struct sockaddr_un sa;
+  if(fill_addr(&sa, path) == -1) return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd == -1) return -1;
+
+  unlink(path);
+  if(bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1 || chmod(path, S_IRUSR | S_IWUSR) == -1 ||
+     listen(fd, 1) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Accept the successor on control socket *@ctlfd and pass it @fd.  A peer of
+// another user or one that doesn't send HANDOFF_REQUEST is dropped and the
+// control socket stays up.  Once a successor is verified, the control socket
+// is closed (*@ctlfd set to -1) and @path unlinked before sending, so the
+// successor can create its own.  Returns 0 on success, -1 on error
+int handoff_send_fd(int* ctlfd, const char* path, int fd) {
+  int peer = accept4(*ctlfd, NULL, NULL, SOCK_CLOEXEC);
+  if(peer == -1) return -1;
+  if(check_peer(peer) == -1 || read_request(peer) == -1) {
+    int saved = errno;
+    close(peer);
+    errno = saved;
+    return -1;
+  }
+
+  close(*ctlfd);
+  *ctlfd = -1;
+  unlink(path);
+
+  char byte = 'U';
+  struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf)
+  };
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  int ret = sendmsg(peer, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+  close(peer);
+  return ret;
+}
+
+// Connect to the running server at @path and receive its listening socket.
+// Returns the fd or -1 on error
+int handoff_receive_fd(const char* path) {
+  struct sockaddr_un sa;
+  if(fill_addr(&sa, path) == -1) return -1;
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(sock == -1) return -1;
+  char request = HANDOFF_REQUEST;
+  if(connect(sock, (struct sockaddr*)&sa, sizeof(sa)) == -1 || check_peer(sock) == -1 ||
+     send(sock, &request, 1, MSG_NOSIGNAL) != 1) {
+    int saved = errno;
+    close(sock);
+    errno = saved;
+    return -1;
+  }
+
+  char byte;
+  struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf)
+  };
+
+  ssize_t n;
+  while((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+  }
+  close(sock);
+
+  struct cmsghdr* cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    if(n != -1) errno = EPROTO;
+    return -1;
+  }
+
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+// Hot restart: a running server listens on a UNIX control socket.  A new
+// server started in upgrade mode connects to it and receives the listening
+// TCP socket over SCM_RIGHTS, after which the old server stops accepting,
+// drains its connections and exits.  Both ends must run as the same user and
+// the successor has to ask for the socket before it is handed over.
+
+int handoff_listen(const char* path);
+int handoff_send_fd(int* ctlfd, const char* path, int fd);
+int handoff_receive_fd(const char* path);
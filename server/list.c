@@ -49,6 +49,9 @@ void free_all_threads(node_t **head) {
   while(*indirect != NULL) {
     node_t* current = *indirect;
     *indirect = current->next;
+#ifndef _DEBUG_NO_THREADS
+    pthread_join(current->tid, NULL);
+#endif
     free(current);
     current = NULL;
   }
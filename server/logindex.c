@@ -0,0 +1,276 @@
+#define _GNU_SOURCE // for memrchr()
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "logindex.h"
+#include "utility.h"
+
+enum {
+  SCAN_MAX_THREADS = 16,
+  SCAN_MIN_CHUNK = 4 << 20,     // not worth a thread below this
+  TAIL_READ_SIZE = 64 << 10
+};
+
+static const char INDEX_MAGIC[8] = "AESDIDX1";
+
+// checkpoint file layout, followed by nmarks 64-bit offsets
+typedef struct index_header_t {
+  char magic[8];
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t length;
+  uint64_t count;
+  uint64_t nmarks;
+  uint32_t stride;
+  uint32_t reserved;
+} index_header_t;
+
+void log_index_free(log_index_t* index) {
+  free(index->marks);
+  memset(index, 0, sizeof(*index));
+}
+
+static int reserve_marks(log_index_t* index, size_t nmarks) {
+  if(nmarks <= index->cap) return 0;
+  size_t cap = index->cap ? index->cap : 64;
+  while(cap < nmarks) cap *= 2;
+  off_t* marks = realloc(index->marks, cap * sizeof(off_t));
+  if(!marks) return -1;
+  index->marks = marks;
+  index->cap = cap;
+  return 0;
+}
+
+// Account for @len bytes of @buf that were written at file offset @start
+void log_index_add(log_index_t* index, off_t start, const char* buf, size_t len) {
+  const char* p = buf;
+  const char* end = buf + len;
+  while((p = memchr(p, '\n', end - p)) != NULL) {
+    p++;
+    index->count++;
+    index->length = start + (p - buf);
+    if(index->count % LOG_INDEX_STRIDE == 0 &&
+       reserve_marks(index, index->nmarks + 1) == 0) {
+      index->marks[index->nmarks++] = index->length;
+    }
+  }
+}
+
+typedef struct scan_chunk_t {
+  const char* base;   // mapping of the scanned range
+  off_t base_off;     // file offset of base
+  size_t begin;       // chunk is [begin, end) within the mapping
+  size_t end;
+  uint64_t first;     // lines completed before this chunk
+  uint64_t lines;     // lines completed within this chunk
+  size_t last_end;    // mapping offset just past the chunk's last '\n'
+  log_index_t* index;
+} scan_chunk_t;
+
+static void* count_chunk(void* arg) {
+  scan_chunk_t* c = arg;
+  const char* p = c->base + c->begin;
+  const char* end = c->base + c->end;
+  while((p = memchr(p, '\n', end - p)) != NULL) {
+    p++;
+    c->lines++;
+    c->last_end = p - c->base;
+  }
+  return NULL;
+}
+
+// second pass, every chunk fills its own disjoint range of marks
+static void* mark_chunk(void* arg) {
+  scan_chunk_t* c = arg;
+  const char* p = c->base + c->begin;
+  const char* end = c->base + c->end;
+  uint64_t line = c->first;
+  while((p = memchr(p, '\n', end - p)) != NULL) {
+    p++;
+    line++;
+    if(line % LOG_INDEX_STRIDE == 0) {
+      c->index->marks[line / LOG_INDEX_STRIDE - 1] = c->base_off + (p - c->base);
+    }
+  }
+  return NULL;
+}
+
+static void run_chunks(scan_chunk_t* chunks, int n, void* (*fn)(void*)) {
+  pthread_t tids[SCAN_MAX_THREADS];
+  bool started[SCAN_MAX_THREADS] = {false};
+  for(int i = 1; i < n; i++) {
+    started[i] = pthread_create(&tids[i], NULL, fn, &chunks[i]) == 0;
+  }
+  fn(&chunks[0]);
+  for(int i = 1; i < n; i++) {
+    if(started[i]) {
+      pthread_join(tids[i], NULL);
+    } else {
+      fn(&chunks[i]);
+    }
+  }
+}
+
+// Extend @index over the file contents from index->length up to @to.  The
+// range is mapped and scanned by several threads in two passes: count the
+// lines of every chunk, then record the marks falling into each chunk.
+int log_index_scan(log_index_t* index, int fd, off_t to) {
+  off_t from = index->length;
+  if(to <= from) return 0;
+
+  long page = sysconf(_SC_PAGESIZE);
+  off_t map_off = from - from % page;
+  size_t map_len = to - map_off;
+  char* map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_off);
+  if(map == MAP_FAILED) return -1;
+  madvise(map, map_len, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+  size_t begin = from - map_off;
+  size_t span = map_len - begin;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int n = span / SCAN_MIN_CHUNK + 1;
+  if(n > ncpu) n = ncpu > 0 ? ncpu : 1;
+  if(n > SCAN_MAX_THREADS) n = SCAN_MAX_THREADS;
+
+  scan_chunk_t chunks[SCAN_MAX_THREADS];
+  for(int i = 0; i < n; i++) {
+    chunks[i] = (scan_chunk_t){
+      .base = map,
+      .base_off = map_off,
+      .begin = begin + span * i / n,
+      .end = begin + span * (i + 1) / n,
+      .index = index
+    };
+  }
+
+  run_chunks(chunks, n, count_chunk);
+
+  uint64_t total = index->count;
+  size_t last_end = 0;
+  for(int i = 0; i < n; i++) {
+    chunks[i].first = total;
+    total += chunks[i].lines;
+    if(chunks[i].lines) last_end = chunks[i].last_end;
+  }
+
+  int ret = 0;
+  if(reserve_marks(index, total / LOG_INDEX_STRIDE) == -1) {
+    ret = -1;
+  } else if(total != index->count) {
+    run_chunks(chunks, n, mark_chunk);
+    index->count = total;
+    index->nmarks = total / LOG_INDEX_STRIDE;
+    index->length = map_off + last_end;
+  }
+
+  munmap(map, map_len);
+  return ret;
+}
+
+// Drop a partially written last record, left behind by a crash, so the file
+// ends with '\n'.  Returns the resulting file size or -1 on error
+off_t log_recover_tail(int fd) {
+  struct stat st;
+  if(fstat(fd, &st) == -1) return -1;
+
+  char buf[TAIL_READ_SIZE];
+  off_t end = st.st_size;
+  off_t keep = 0;
+  while(end > 0) {
+    size_t len = end < TAIL_READ_SIZE ? (size_t)end : TAIL_READ_SIZE;
+    if(pread(fd, buf, len, end - len) != (ssize_t)len) return -1;
+    char* nl = memrchr(buf, '\n', len);
+    if(nl) {
+      keep = end - len + (nl - buf) + 1;
+      break;
+    }
+    end -= len;
+  }
+
+  if(keep != st.st_size) {
+    ERROR_LOG("Dropping %lld bytes of incomplete record", (long long)(st.st_size - keep));
+    if(ftruncate(fd, keep) == -1) return -1;
+  }
+  return keep;
+}
+
+// Load the checkpoint at @path if it still describes a prefix of @fd.
+// Returns 0 on success, -1 when there is no usable checkpoint
+int log_index_load(log_index_t* index, const char* path, int fd) {
+  int ifd = open(path, O_RDONLY | O_CLOEXEC);
+  if(ifd == -1) return -1;
+
+  int ret = -1;
+  index_header_t hdr;
+  struct stat st;
+  char last;
+  if(read(ifd, &hdr, sizeof(hdr)) != sizeof(hdr) || fstat(fd, &st) == -1) goto out;
+  if(memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) != 0 || hdr.stride != LOG_INDEX_STRIDE ||
+     hdr.dev != (uint64_t)st.st_dev || hdr.ino != (uint64_t)st.st_ino ||
+     hdr.length > (uint64_t)st.st_size || hdr.nmarks != hdr.count / LOG_INDEX_STRIDE) {
+    goto out;
+  }
+  // the checkpointed prefix must still end on a record boundary
+  if(hdr.length > 0 && (pread(fd, &last, 1, hdr.length - 1) != 1 || last != '\n')) goto out;
+
+  log_index_free(index);
+  if(reserve_marks(index, hdr.nmarks) == -1) goto out;
+  size_t bytes = hdr.nmarks * sizeof(off_t);
+  if(read(ifd, index->marks, bytes) != (ssize_t)bytes) {
+    log_index_free(index);
+    goto out;
+  }
+  index->nmarks = hdr.nmarks;
+  index->count = hdr.count;
+  index->length = hdr.length;
+  ret = 0;
+
+out:
+  close(ifd);
+  return ret;
+}
+
+// Write a checkpoint of @index for @fd to @path, replacing it atomically
+int log_index_save(const log_index_t* index, const char* path, int fd) {
+  struct stat st;
+  if(fstat(fd, &st) == -1) return -1;
+
+  char* tmp = malloc(strlen(path) + 5);
+  if(!tmp) return -1;
+  sprintf(tmp, "%s.tmp", path);
+
+  int ret = -1;
+  int ifd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(ifd == -1) goto out;
+
+  index_header_t hdr = {
+    .dev = st.st_dev,
+    .ino = st.st_ino,
+    .length = index->length,
+    .count = index->count,
+    .nmarks = index->nmarks,
+    .stride = LOG_INDEX_STRIDE
+  };
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+  size_t bytes = index->nmarks * sizeof(off_t);
+  if(write(ifd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+     (bytes == 0 || write(ifd, index->marks, bytes) == (ssize_t)bytes) &&
+     fsync(ifd) == 0) {
+    ret = 0;
+  }
+  close(ifd);
+
+  if(ret == 0 && rename(tmp, path) == -1) ret = -1;
+  if(ret == -1) unlink(tmp);
+
+out:
+  free(tmp);
+  return ret;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// In-memory metadata of a log file: number of complete ('\n' terminated)
+// lines, bytes they cover and a sparse line index.  The end offset of every
+// LOG_INDEX_STRIDE-th line is kept, so line n can be found by reading from
+// marks[n / LOG_INDEX_STRIDE - 1] onwards without one entry per line.
+enum { LOG_INDEX_STRIDE = 64 };
+
+typedef struct log_index_t {
+  uint64_t count;   // complete lines
+  off_t length;     // end offset of the last complete line
+  off_t* marks;     // marks[i] = end offset of line (i + 1) * LOG_INDEX_STRIDE
+  size_t nmarks;
+  size_t cap;
+} log_index_t;
+
+void log_index_free(log_index_t* index);
+void log_index_add(log_index_t* index, off_t start, const char* buf, size_t len);
+int log_index_scan(log_index_t* index, int fd, off_t to);
+off_t log_recover_tail(int fd);
+int log_index_load(log_index_t* index, const char* path, int fd);
+int log_index_save(const log_index_t* index, const char* path, int fd);
@@ -0,0 +1,115 @@
+#define _GNU_SOURCE // for asprintf()
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "namespace.h"
+#include "utility.h"
+
+int ns_registry_init(ns_registry_t* reg, const char* base_path, bool enabled, int max_count,
+                     log_open_mode_t mode) {
+  memset(reg, 0, sizeof(*reg));
+  reg->enabled = enabled;
+  reg->max_count = max_count;
+  reg->mode = mode;
+  if((reg->base_path = strdup(base_path)) == NULL) return -1;
+  if((reg->default_log = datalog_open(base_path, "", mode)) == NULL) {
+    free(reg->base_path);
+    return -1;
+  }
+  pthread_rwlock_init(&reg->lock, NULL);
+  return 0;
+}
+
+void ns_registry_destroy(ns_registry_t* reg) {
+  datalog_t* cur = reg->logs;
+  while(cur != NULL) {
+    datalog_t* next = cur->next;
+    datalog_close(cur);
+    cur = next;
+  }
+  datalog_close(reg->default_log);
+  pthread_rwlock_destroy(&reg->lock);
+  free(reg->base_path);
+  memset(reg, 0, sizeof(*reg));
+}
+
+// End the subscriptions of every log, see datalog_end_subscriptions()
+void ns_end_subscriptions(ns_registry_t* reg) {
+  pthread_rwlock_rdlock(&reg->lock);
+  datalog_end_subscriptions(reg->default_log);
+  for(datalog_t* cur = reg->logs; cur != NULL; cur = cur->next) {
+    datalog_end_subscriptions(cur);
+  }
+  pthread_rwlock_unlock(&reg->lock);
+}
+
+static bool is_name_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c == '-';
+}
+
+// caller holds reg->lock for reading or writing
+static datalog_t* find_locked(ns_registry_t* reg, const char* name, size_t name_len) {
+  for(datalog_t* cur = reg->logs; cur != NULL; cur = cur->next) {
+    if(strlen(cur->name) == name_len && memcmp(cur->name, name, name_len) == 0) {
+      return cur;
+    }
+  }
+  return NULL;
+}
+
+// Pick the log for message @msg.  On return *tag_len holds the number of
+// leading bytes ("@<name> ") that are not part of the payload.  Untagged or
+// malformed tags resolve to the default log.  Returns NULL when a new
+// namespace could not be created.
+datalog_t* ns_resolve(ns_registry_t* reg, const char* msg, size_t len, size_t* tag_len) {
+  *tag_len = 0;
+  if(!reg->enabled || len < 3 || msg[0] != '@') return reg->default_log;
+
+  size_t name_len = 0;
+  while(1 + name_len < len && name_len <= NS_NAME_MAX && is_name_char(msg[1 + name_len])) {
+    name_len++;
+  }
+  if(name_len == 0 || name_len > NS_NAME_MAX || 1 + name_len >= len || msg[1 + name_len] != ' ') {
+    return reg->default_log;
+  }
+  const char* name = msg + 1;
+
+  pthread_rwlock_rdlock(&reg->lock);
+  datalog_t* log = find_locked(reg, name, name_len);
+  pthread_rwlock_unlock(&reg->lock);
+
+  bool full = false;
+  if(log == NULL) {
+    pthread_rwlock_wrlock(&reg->lock);
+    // another client may have created it while we were unlocked
+    if((log = find_locked(reg, name, name_len)) == NULL) {
+      if(reg->count >= reg->max_count) {
+        full = true;
+      } else {
+        char ns_name[NS_NAME_MAX + 1] = {0};
+        memcpy(ns_name, name, name_len);
+        char* path = NULL;
+        if(asprintf(&path, "%s.%s", reg->base_path, ns_name) != -1) {
+          if((log = datalog_open(path, ns_name, reg->mode)) != NULL) {
+            log->next = reg->logs;
+            reg->logs = log;
+            reg->count++;
+            DEBUG_LOG("Created namespace %s at %s", ns_name, path);
+          }
+          free(path);
+        }
+      }
+    }
+    pthread_rwlock_unlock(&reg->lock);
+  }
+
+  if(full) {
+    ERROR_LOG("Namespace limit of %d reached, storing \"%.*s\" message in the default log",
+              reg->max_count, (int)name_len, name);
+    return reg->default_log;
+  }
+  if(log) *tag_len = 1 + name_len + 1;
+  return log;
+}
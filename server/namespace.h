@@ -0,0 +1,29 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "datalog.h"
+
+// Protocol extension: a message starting with "@<name> " is stored in, and
+// answered from, the log of namespace <name> instead of the default log.
+// Names are 1..NS_NAME_MAX characters of [A-Za-z0-9_-].
+// Once max_count namespaces exist, messages tagged with a new name are stored
+// in the default log, tag included.
+enum { NS_NAME_MAX = 32 };
+
+typedef struct ns_registry_t {
+  pthread_rwlock_t lock;     // guards logs and count, not the logs themselves
+  char* base_path;           // namespace <name> is stored in "<base_path>.<name>"
+  bool enabled;              // false: tags are not parsed, everything is default
+  log_open_mode_t mode;      // how existing log files are opened
+  datalog_t* default_log;
+  datalog_t* logs;           // tagged namespaces, created on first use
+  int count;
+  int max_count;
+} ns_registry_t;
+
+int ns_registry_init(ns_registry_t* reg, const char* base_path, bool enabled, int max_count,
+                     log_open_mode_t mode);
+void ns_registry_destroy(ns_registry_t* reg);
+void ns_end_subscriptions(ns_registry_t* reg);
+datalog_t* ns_resolve(ns_registry_t* reg, const char* msg, size_t len, size_t* tag_len);
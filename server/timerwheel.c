@@ -0,0 +1,115 @@
+#include <string.h>
+#include "timerwheel.h"
+
+// largest delay a timer can be armed for, longer ones are clamped
+#define TW_MAX_TICKS ((1ull << (TW_BITS * TW_LEVELS)) - 1)
+
+void tw_init(timer_wheel_t* tw) {
+  memset(tw->slots, 0, sizeof(tw->slots));
+  atomic_init(&tw->now, 0);
+  pthread_mutex_init(&tw->lock, NULL);
+}
+
+void tw_destroy(timer_wheel_t* tw) {
+  pthread_mutex_destroy(&tw->lock);
+}
+
+uint64_t tw_now(timer_wheel_t* tw) {
+  return atomic_load_explicit(&tw->now, memory_order_relaxed);
+}
+
+uint64_t tw_ms_to_ticks(uint64_t ms) {
+  return (ms + TW_TICK_MS - 1) / TW_TICK_MS;
+}
+
+void tw_timer_init(tw_timer_t* timer, tw_callback_t cb, void* ctx) {
+  memset(timer, 0, sizeof(*timer));
+  timer->cb = cb;
+  timer->ctx = ctx;
+}
+
+static void unlink_timer(tw_timer_t* timer) {
+  if(timer->pprev == NULL) return;
+  *timer->pprev = timer->next;
+  if(timer->next) timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+// place @timer in the slot matching its distance from now.  Caller holds lock
+static void link_timer(timer_wheel_t* tw, tw_timer_t* timer) {
+  uint64_t now = tw_now(tw);
+  uint64_t delta = timer->expires > now ? timer->expires - now : 0;
+
+  int level = 0;
+  while(level < TW_LEVELS - 1 && delta >= (1ull << (TW_BITS * (level + 1)))) {
+    level++;
+  }
+  unsigned slot = (timer->expires >> (TW_BITS * level)) & (TW_SLOTS - 1);
+
+  tw_timer_t** head = &tw->slots[level][slot];
+  timer->next = *head;
+  if(*head) (*head)->pprev = &timer->next;
+  timer->pprev = head;
+  *head = timer;
+}
+
+static void schedule_locked(timer_wheel_t* tw, tw_timer_t* timer, uint64_t ticks) {
+  unlink_timer(timer);
+  if(ticks == 0) ticks = 1;
+  if(ticks > TW_MAX_TICKS) ticks = TW_MAX_TICKS;
+  timer->expires = tw_now(tw) + ticks;
+  link_timer(tw, timer);
+}
+
+// (Re)arm @timer to fire @ticks ticks from now
+void tw_schedule(timer_wheel_t* tw, tw_timer_t* timer, uint64_t ticks) {
+  pthread_mutex_lock(&tw->lock);
+  schedule_locked(tw, timer, ticks);
+  pthread_mutex_unlock(&tw->lock);
+}
+
+// Disarm @timer.  Once this returns its callback is not running and will not
+// run again until it is re-armed.
+void tw_cancel(timer_wheel_t* tw, tw_timer_t* timer) {
+  pthread_mutex_lock(&tw->lock);
+  unlink_timer(timer);
+  pthread_mutex_unlock(&tw->lock);
+}
+
+// move every timer of a higher level slot down to where it now belongs
+static void cascade(timer_wheel_t* tw, int level, unsigned slot) {
+  tw_timer_t* cur = tw->slots[level][slot];
+  tw->slots[level][slot] = NULL;
+  while(cur != NULL) {
+    tw_timer_t* next = cur->next;
+    cur->pprev = NULL;
+    cur->next = NULL;
+    link_timer(tw, cur);
+    cur = next;
+  }
+}
+
+// Move time forward by @ticks, running the callbacks of expired timers
+void tw_advance(timer_wheel_t* tw, uint64_t ticks) {
+  pthread_mutex_lock(&tw->lock);
+  while(ticks-- > 0) {
+    uint64_t now = tw_now(tw) + 1;
+    atomic_store_explicit(&tw->now, now, memory_order_relaxed);
+
+    // when a level wraps, the next slot of the level above comes due
+    for(int level = 1; level < TW_LEVELS; level++) {
+      if((now & ((1ull << (TW_BITS * level)) - 1)) != 0) break;
+      cascade(tw, level, (now >> (TW_BITS * level)) & (TW_SLOTS - 1));
+    }
+
+    tw_timer_t** head = &tw->slots[0][now & (TW_SLOTS - 1)];
+    while(*head != NULL) {
+      tw_timer_t* timer = *head;
+      unlink_timer(timer);
+      uint64_t rearm = timer->cb(timer, timer->ctx);
+      if(rearm) schedule_locked(tw, timer, rearm);
+    }
+  }
+  pthread_mutex_unlock(&tw->lock);
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel.  Time advances in ticks (driven by a timerfd in
+// the main thread).  Level 0 has one slot per tick, every higher level has
+// slots TW_SLOTS times coarser; timers cascade down a level as their
+// expiry comes near.  Adding, re-arming and cancelling are O(1).
+enum { TW_BITS = 6, TW_SLOTS = 1 << TW_BITS, TW_LEVELS = 4, TW_TICK_MS = 100 };
+
+struct tw_timer_t;
+
+// Called with the wheel locked, so it must not call tw_* functions.  Return
+// 0 to let the timer expire or a number of ticks to re-arm it for.
+typedef uint64_t (*tw_callback_t)(struct tw_timer_t* timer, void* ctx);
+
+typedef struct tw_timer_t {
+  struct tw_timer_t* next;
+  struct tw_timer_t** pprev;  // NULL when not armed
+  uint64_t expires;           // absolute tick
+  tw_callback_t cb;
+  void* ctx;
+} tw_timer_t;
+
+typedef struct timer_wheel_t {
+  pthread_mutex_t lock;
+  atomic_uint_fast64_t now;  // current tick, readable without the lock
+  tw_timer_t* slots[TW_LEVELS][TW_SLOTS];
+} timer_wheel_t;
+
+void tw_init(timer_wheel_t* tw);
+void tw_destroy(timer_wheel_t* tw);
+uint64_t tw_now(timer_wheel_t* tw);
+uint64_t tw_ms_to_ticks(uint64_t ms);
+void tw_timer_init(tw_timer_t* timer, tw_callback_t cb, void* ctx);
+void tw_schedule(timer_wheel_t* tw, tw_timer_t* timer, uint64_t ticks);
+void tw_cancel(timer_wheel_t* tw, tw_timer_t* timer);
+void tw_advance(timer_wheel_t* tw, uint64_t ticks);
@@ -1,16 +1,233 @@
+#define _GNU_SOURCE // for cpu_set_t in config.h
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <poll.h>
-#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <syslog.h>
 #include "worker.h"
+#include "coroutine.h"
 #include "utility.h"
 
+// Deadlines of one connection.  The timers fire in the main thread, which
+// shuts the socket down so the worker's poll() wakes up and sees EOF.
+typedef struct conn_timers_t {
+  int fd;
+  timer_wheel_t* wheel;
+  uint64_t idle_ticks;
+  atomic_uint_fast64_t last_activity;  // tick of the last bytes received or sent
+  _Atomic(const char*) expired;        // which deadline was missed, if any
+  tw_timer_t idle;
+  tw_timer_t header;
+  tw_timer_t request;
+} conn_timers_t;
+
+static uint64_t expire_conn(conn_timers_t* ct, const char* reason) {
+  atomic_store(&ct->expired, reason);
+  shutdown(ct->fd, SHUT_RDWR);
+  return 0;
+}
+
+static uint64_t idle_expired(tw_timer_t* timer, void* ctx) {
+  (void)timer;
+  conn_timers_t* ct = ctx;
+  // activity only records a tick, the timer is pushed back lazily here
+  uint64_t idle_for = tw_now(ct->wheel) - atomic_load(&ct->last_activity);
+  if(idle_for < ct->idle_ticks) return ct->idle_ticks - idle_for;
+  return expire_conn(ct, "idle");
+}
+
+static uint64_t header_expired(tw_timer_t* timer, void* ctx) {
+  (void)timer;
+  return expire_conn(ctx, "header");
+}
+
+static uint64_t request_expired(tw_timer_t* timer, void* ctx) {
+  (void)timer;
+  return expire_conn(ctx, "request");
+}
+
+static void conn_timers_start(conn_timers_t* ct, int fd, timer_wheel_t* wheel,
+                              const conn_timeouts_t* timeouts) {
+  ct->fd = fd;
+  ct->wheel = wheel;
+  ct->idle_ticks = tw_ms_to_ticks(timeouts->idle_s * 1000ull);
+  atomic_init(&ct->last_activity, tw_now(wheel));
+  atomic_init(&ct->expired, NULL);
+  tw_timer_init(&ct->idle, idle_expired, ct);
+  tw_timer_init(&ct->header, header_expired, ct);
+  tw_timer_init(&ct->request, request_expired, ct);
+
+  if(timeouts->idle_s) tw_schedule(wheel, &ct->idle, ct->idle_ticks);
+  if(timeouts->header_s) tw_schedule(wheel, &ct->header, tw_ms_to_ticks(timeouts->header_s * 1000ull));
+  if(timeouts->request_s) tw_schedule(wheel, &ct->request, tw_ms_to_ticks(timeouts->request_s * 1000ull));
+}
+
+// must be called before the socket is closed
+static void conn_timers_stop(conn_timers_t* ct) {
+  tw_cancel(ct->wheel, &ct->idle);
+  tw_cancel(ct->wheel, &ct->header);
+  tw_cancel(ct->wheel, &ct->request);
+}
+
+// Send the first @len bytes of file @fd.  sendfile() moves the data from the
+// page cache straight to the socket, so the reply needs no buffer however
+// large the log has grown.  The connection's deadlines stay armed, progress
+// counts as activity, so a client that stops reading is cut off by the idle
+// timer.  Returns 0 on success
+static int send_file(int clientfd, int shutdownfd, int fd, off_t len, conn_timers_t* timers) {
+  struct pollfd pollfds[2] = {
+    [0] = { .fd = clientfd, .events = POLLOUT},
+    [1] = { .fd = shutdownfd, .events = POLLIN}
+  };
+  off_t offset = 0;
+  while(offset < len) {
+    ssize_t n = sendfile(clientfd, fd, &offset, len - offset);
+    if(n == 0) return -1;  // file shorter than the size taken
+    if(n > 0) atomic_store(&timers->last_activity, tw_now(timers->wheel));
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if(co_poll(pollfds, 2, -1) == -1 && errno != EINTR) return -1;
+      if(pollfds[1].revents & POLLIN) return -1;
+    } else if(n == -1 && errno != EINTR) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// A message that outgrew the stream threshold.  Its bytes live in an
+// unlinked file in SPILL_DIR, which disappears on close whatever happens to
+// the connection; only the start is kept in memory to find its namespace.
+#define SPILL_DIR "/var/tmp"
+typedef struct spill_t {
+  int fd;
+  size_t len;
+  char head[NS_NAME_MAX + 2];  // enough of the message for ns_resolve()
+  size_t head_len;
+} spill_t;
+
+static int spill_write(spill_t* spill, const char* buf, size_t len) {
+  if(spill->head_len < sizeof(spill->head)) {
+    size_t n = sizeof(spill->head) - spill->head_len;
+    if(n > len) n = len;
+    memcpy(spill->head + spill->head_len, buf, n);
+    spill->head_len += n;
+  }
+  while(len > 0) {
+    ssize_t n = write(spill->fd, buf, len);
+    if(n == -1 && errno == EINTR) continue;
+    if(n == -1) return -1;
+    buf += n;
+    len -= n;
+    spill->len += n;
+  }
+  return 0;
+}
+
+// Move the @len buffered bytes of @buf into a new spill file
+static int spill_open(spill_t* spill, const char* buf, size_t len) {
+  spill->len = 0;
+  spill->head_len = 0;
+  spill->fd = open(SPILL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if(spill->fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+    // no O_TMPFILE support on this filesystem, unlink by hand
+    char path[] = SPILL_DIR "/aesdsocket.spill.XXXXXX";
+    spill->fd = mkostemp(path, O_CLOEXEC);
+    if(spill->fd != -1) unlink(path);
+  }
+  if(spill->fd == -1) return -1;
+  if(spill_write(spill, buf, len) == -1) {
+    close(spill->fd);
+    spill->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+// Protocol extension: with subscriptions enabled, the message SUBSCRIBE_MSG
+// (after an optional namespace tag) is not stored.  Instead the connection
+// stays open and every record appended to that log from then on is pushed to
+// it, timestamps included.
+static const char SUBSCRIBE_MSG[] = "!subscribe\n";
+
+static bool is_subscribe(const server_config_t* config, const char* msg, size_t len) {
+  return config->subscriptions && len == sizeof(SUBSCRIBE_MSG) - 1 &&
+         memcmp(msg, SUBSCRIBE_MSG, len) == 0;
+}
+
+// Push what is appended to @log to the client until it disconnects, falls
+// more than subscriber_lag bytes behind while records keep coming, the log
+// ends the subscription or the server shuts down.  The connection deadlines
+// don't apply, a subscriber is silent by design.
+static void follow_log(int clientfd, int shutdownfd, datalog_t* log,
+                       const server_config_t* config) {
+  datalog_sub_t sub;
+  off_t cursor = datalog_subscribe(log, &sub);
+  if(cursor == -1) {
+    ERROR_LOG("Client [%d]: Failed to subscribe: %s", clientfd, strerror(errno));
+    return;
+  }
+  DEBUG_LOG("Client [%d]: Subscribed to %s", clientfd, log->path);
+
+  enum {POLLFD_SIZE = 3};
+  struct pollfd pollfds[POLLFD_SIZE] = {
+    [0] = { .fd = clientfd, .events = POLLIN},
+    [1] = { .fd = shutdownfd, .events = POLLIN},
+    [2] = { .fd = sub.fd, .events = POLLIN}
+  };
+  char discard[256];
+
+  off_t seen = cursor;  // log size at the previous check
+  while(!atomic_load(&sub.ended)) {
+    off_t end = datalog_size(log);
+    if(end == -1) break;
+    // only a backlog that keeps growing counts, a caught up subscriber
+    // always gets the next record however large
+    if(cursor < seen && end - cursor > config->subscriber_lag) {
+      ERROR_LOG("Client [%d]: Subscriber fell %lld bytes behind. Closing down client.",
+                clientfd, (long long)(end - cursor));
+      break;
+    }
+    seen = end;
+
+    // only wait for room in the send buffer while there is something to send
+    pollfds[0].events = POLLIN | (cursor < end ? POLLOUT : 0);
+    if(co_poll(pollfds, POLLFD_SIZE, -1) == -1) {
+      if(errno == EINTR) continue;
+      break;
+    }
+    if(pollfds[1].revents & POLLIN) break;
+    if(pollfds[2].revents & POLLIN) {
+      uint64_t appends;
+      if(read(sub.fd, &appends, sizeof(appends)) == -1 && errno != EAGAIN) break;
+    }
+    if(pollfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      // anything a subscriber sends is ignored, EOF ends the subscription
+      ssize_t n = recv(clientfd, discard, sizeof(discard), 0);
+      if(n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) break;
+    }
+    if((pollfds[0].revents & POLLOUT) && cursor < end) {
+      ssize_t n = sendfile(clientfd, log->fd, &cursor, end - cursor);
+      if(n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) break;
+    }
+  }
+
+  DEBUG_LOG("Client [%d]: Unsubscribed from %s", clientfd, log->path);
+  datalog_unsubscribe(log, &sub);
+}
+
+// Coroutine entry point, see thread_proc()
+void conn_proc(void* argument){
+  thread_proc(argument);
+}
 
 void* thread_proc(void* argument){
   
@@ -18,8 +235,10 @@ void* thread_proc(void* argument){
   int clientfd = arg->sockfd;
   int shutdownfd = arg->shutdownfd;
   atomic_int* completed = arg->completed;
-  FILE* outfile = arg->outfile;
-  pthread_mutex_t* lock = arg->lock;
+  ns_registry_t* registry = arg->registry;
+  timer_wheel_t* wheel = arg->wheel;
+  const server_config_t* config = arg->config;
+  capture_t* capture = arg->capture;
   free(arg);
 
   enum {POLLFD_SIZE = 2};
@@ -28,24 +247,35 @@ void* thread_proc(void* argument){
     [1] = { .fd = shutdownfd, .events = POLLIN}
   };
 
+  // messages are collected in memory up to the stream threshold, then
+  // spill to a file so a connection's memory stays bounded
   char* buffer = NULL;
-  size_t buffer_size;
-  char chunk[256];
+  size_t buffer_size = 0;
+  size_t buffered = 0;
+  spill_t spill = { .fd = -1 };
+  char chunk[4096];
+  char last = '\0';
 
   FILE* memstream = open_memstream(&buffer, &buffer_size);
   if(!memstream){
     DEBUG_LOG("Client [%d] failed to create memstream: %s", clientfd, strerror(errno));
-    atomic_store(completed, 1);
+    if(completed) atomic_store(completed, 1);
     close(clientfd);
     return NULL;
   }
 
   bool err = false;
   bool con_closed = false;
+  bool got_data = false;
+
+  conn_timers_t timers;
+  conn_timers_start(&timers, clientfd, wheel, &config->timeouts);
+  uint32_t capture_id = capture_conn_open(capture);
 
   while(true){
     
-    int poll_ret_val = poll(pollfds, POLLFD_SIZE, -1 /*infinite wait*/ );
+    // parks only this connection when running as a coroutine
+    int poll_ret_val = co_poll(pollfds, POLLFD_SIZE, -1 /*infinite wait*/ );
 
     // #1 check error + EINTR: if true then continue polling
     if(poll_ret_val == -1 && errno == EINTR) continue;
@@ -64,16 +294,48 @@ void* thread_proc(void* argument){
     }
 
     // #4 check if data is ready to be read on socket: If true
-    // then read sizeof(chunk) and add it memstream.  Break
-    // from loop if recieved a message stop char '\n', on error
+    // then read sizeof(chunk) and add it memstream (or the spill file).
+    // Break from loop if recieved a message stop char '\n', on error
     // or if connection was closed by sender
     if(pollfds[0].revents & POLLIN) {
       DEBUG_LOG("Client [%d]: Socket has data ready to be read", clientfd);
       ssize_t n = recv(clientfd, chunk, sizeof(chunk), 0);
       if(n > 0 /* data read, copy to memstream*/) {
-        fwrite(chunk, sizeof(char), n, memstream);
+        atomic_store(&timers.last_activity, tw_now(wheel));
+        capture_conn_data(capture, capture_id, chunk, n);
+        if(!got_data) {
+          got_data = true;
+          tw_cancel(wheel, &timers.header);
+        }
+        last = chunk[n-1];
+        if(spill.fd != -1) {
+          if(spill_write(&spill, chunk, n) == -1) {
+            ERROR_LOG("Client [%d]: Failed to spill message: %s", clientfd, strerror(errno));
+            err = true;
+            break;
+          }
+        } else {
+          fwrite(chunk, sizeof(char), n, memstream);
+          buffered += n;
+          if(buffered > (size_t)config->stream_threshold) {
+            // too big to keep in memory, continue on disk
+            fflush(memstream);
+            if(spill_open(&spill, buffer, buffer_size) == -1) {
+              ERROR_LOG("Client [%d]: Failed to spill message: %s", clientfd, strerror(errno));
+              err = true;
+              break;
+            }
+            DEBUG_LOG("Client [%d]: Message exceeds %d bytes, streaming to disk",
+                      clientfd, config->stream_threshold);
+            fclose(memstream);
+            free(buffer);
+            memstream = NULL;
+            buffer = NULL;
+            buffer_size = 0;
+          }
+        }
         // check for end of message (stop char is '\n') 
-        if(chunk[n-1] == '\n') { // check for stop char '\n'
+        if(last == '\n') { // check for stop char '\n'
           break;
         }
       } else if (n == 0 /* connection closed by sender */) {
@@ -89,45 +351,66 @@ void* thread_proc(void* argument){
     }
   }
 
-  fclose(memstream); // finalizes buffer and buffer_size
+  if(memstream) fclose(memstream); // finalizes buffer and buffer_size
+
+  // the deadlines stay armed until the reply is out
+  if(atomic_load(&timers.expired)) err = true;
 
-  if(!err && buffer_size > 0){
+  size_t msg_len = spill.fd != -1 ? spill.len : buffer_size;
+  if(!err && msg_len > 0){
     // we have some data.  Write it if we have a '\n' message
-    if(buffer[buffer_size -1] != '\n') {
+    if(last != '\n') {
       ERROR_LOG("Client [%d]: Message missing newline terminated. Closing down client.", clientfd);
-    } else { /* write to outfile */
-      pthread_mutex_lock(lock);
-      fwrite(buffer, sizeof(char), buffer_size, outfile); // COMMENT: add error handling
-      fflush(outfile);
-      pthread_mutex_unlock(lock);
-
-      // read contents of outfile into buffer and then send over the socket
-      int res_pread = -1;
-      
-      pthread_mutex_lock(lock);
-      struct stat st;
-      fstat(fileno(outfile), &st);
-      
-      char* file_buf = calloc(1, st.st_size);
-      // pread() - atomic read at ofs 0
-      if(file_buf) {
-        res_pread = pread(fileno(outfile), file_buf, st.st_size, 0);
+    } else { /* write to the message's namespace log */
+      size_t tag_len = 0;
+      int ret;
+      bool subscribe = false;
+      datalog_t* log;
+      if(spill.fd != -1) {
+        log = ns_resolve(registry, spill.head, spill.head_len, &tag_len);
+        ret = log ? datalog_append_fd(log, spill.fd, tag_len, msg_len - tag_len) : -1;
+      } else {
+        log = ns_resolve(registry, buffer, buffer_size, &tag_len);
+        subscribe = is_subscribe(config, buffer + tag_len, buffer_size - tag_len);
+        ret = log && !subscribe ? datalog_append(log, buffer + tag_len, buffer_size - tag_len) : 0;
       }
-      pthread_mutex_unlock(lock);
-
-      if(file_buf && res_pread != -1 && !con_closed) {
-        send(clientfd, file_buf, st.st_size, 0);
+      if(log == NULL) {
+        ERROR_LOG("Client [%d]: No log available for message. Closing down client.", clientfd);
+      } else if(subscribe) {
+        conn_timers_stop(&timers);
+        if(!con_closed) follow_log(clientfd, shutdownfd, log, config);
+      } else if(ret == -1) {
+        ERROR_LOG("Client [%d]: Failed to append message: %s", clientfd, strerror(errno));
+      } else {
+        // send the log as it is now, streamed from the file
+        off_t file_size = datalog_size(log);
+        if(file_size != -1 && !con_closed) {
+          // corked, the reply leaves in full segments however it is written
+          int cork = 1;
+          if(config->tcp_cork) setsockopt(clientfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+          send_file(clientfd, shutdownfd, log->fd, file_size, &timers);
+          cork = 0;
+          if(config->tcp_cork) setsockopt(clientfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+        }
       }
-      if(file_buf) free(file_buf);
     }
   }
   
-  // free buffer created by memstream
+  conn_timers_stop(&timers);
+  const char* expired = atomic_load(&timers.expired);
+  if(expired) {
+    ERROR_LOG("Client [%d]: %s timeout expired. Closing down client.", clientfd, expired);
+  }
+
+  capture_conn_close(capture, capture_id);
+
+  // free buffer created by memstream, the spill file goes with its fd
   free(buffer);
+  if(spill.fd != -1) close(spill.fd);
   
   // set the completed flag so the main thread knows to 
   // join this thread id so it is not leaked
-  atomic_store(completed, 1);
+  if(completed) atomic_store(completed, 1);
   close(clientfd);
   
   return NULL;
@@ -2,13 +2,20 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdio.h>
+#include "capture.h"
+#include "config.h"
+#include "namespace.h"
+#include "timerwheel.h"
 
 typedef struct thread_arg_t {
   int sockfd;
   int shutdownfd;
-  atomic_int* completed;
-  FILE* outfile;
-  pthread_mutex_t* lock;
+  atomic_int* completed;  // NULL when running as a coroutine
+  ns_registry_t* registry;
+  timer_wheel_t* wheel;
+  const server_config_t* config;
+  capture_t* capture;     // NULL unless traffic is captured
 } thread_arg_t;
 
 void* thread_proc(void* arg);
+void conn_proc(void* arg);